@@ -32,15 +32,35 @@
 #include <signal.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// From linux/fs.h, which can't be included since it defines BLOCK_SIZE too
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 #define BLOCK_SIZE 1024
 #define NUM_BLOCKS 65536
 #define BLOCKS_PER_FILE 1024
 #define NUM_FILES 256
-#define FIRST_DATA_BLOCK 1001
 #define MAX_FILE_SIZE 1048576
 
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
+// The image lives in an anonymous mapping so the kernel hands out zeroed pages on first
+// touch, and clearing the image just drops the pages instead of writing 64 MiB
+uint8_t (*data)[BLOCK_SIZE];
+uint8_t (*private_data)[BLOCK_SIZE];    // the process's own copy, data unless shared
 
 //512 blocks just for free block map
 uint8_t * free_blocks;
@@ -57,20 +77,119 @@ struct directoryEntry
 struct directoryEntry * directory;
 
 //inode
+// Block numbers fit in 16 bits since NUM_BLOCKS is 65536. Block 0 is the directory and
+// never file data, so 0 marks an unused slot and a zeroed inode needs no setup. Only the
+// slots covered by file_size are ever read.
 struct inode
 {
-  int32_t blocks[BLOCKS_PER_FILE];
   short in_use;
   uint8_t attribute;
   uint32_t file_size;
-  int hr, min, sec; 
+  int64_t mtime;                  // seconds since the epoch
+  uint16_t blocks[BLOCKS_PER_FILE];
 };
 
 
 
 struct inode * inodes;
 
-FILE *fp;
+// Metadata layout. The inode table is sized from the struct so the free block
+// map and the first data block can never overlap it.
+#define FREE_INODE_BLOCK 19
+#define FIRST_INODE_BLOCK 20
+#define INODE_BLOCKS ((NUM_FILES * sizeof(struct inode) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define FREE_BLOCK_MAP (FIRST_INODE_BLOCK + INODE_BLOCKS)
+#define FREE_BLOCK_MAP_BLOCKS (NUM_BLOCKS / BLOCK_SIZE)
+#define CHECKSUM_BLOCK (FREE_BLOCK_MAP + FREE_BLOCK_MAP_BLOCKS)
+#define CHECKSUM_BLOCKS (NUM_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE)
+#define SHARE_BLOCK (CHECKSUM_BLOCK + CHECKSUM_BLOCKS)
+#define SHARE_BLOCKS (NUM_BLOCKS * sizeof(uint16_t) / BLOCK_SIZE)
+#define SNAPSHOT_BLOCK (SHARE_BLOCK + SHARE_BLOCKS)
+#define SNAPSHOT_BLOCKS ((MAX_SNAPSHOTS * sizeof(struct snapshot) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define GENERATION_BLOCK (SNAPSHOT_BLOCK + SNAPSHOT_BLOCKS)
+#define GENERATION_BLOCKS (NUM_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE)
+#define META_CRC_BLOCK (GENERATION_BLOCK + GENERATION_BLOCKS)
+#define META_CRC_BLOCKS 8
+#define FIRST_DATA_BLOCK (META_CRC_BLOCK + META_CRC_BLOCKS)
+
+// The directory only fills blocks 0-17, so block 18 holds the superblock
+#define SUPERBLOCK 18
+#define FS_MAGIC 0x3453464d     // "MFS4"
+
+// generation counts saves (and delta exports). Every block records the generation it
+// last changed in, one past the saved one while the change is unsaved, which is what
+// lets a delta carry only the blocks changed since an older copy.
+struct superblock
+{
+  uint32_t magic;
+  uint32_t metadata_crc;
+  uint32_t generation;
+};
+
+struct superblock * superblock;
+
+// CRC32C of every data block, indexed by block number
+uint32_t * block_crcs;
+
+// Generation each block last changed in, indexed by block number. Data blocks are
+// stamped as they are written; metadata blocks are stamped when a save or export finds
+// their CRC differs from the one remembered in meta_crcs.
+uint32_t * block_gens;
+uint32_t * meta_crcs;
+
+// Data blocks changed since they were last written to the image file, so the background
+// flusher only has to write those (plus the metadata)
+uint8_t dirty_blocks[NUM_BLOCKS];
+int dirty_count;
+
+void markDirty(int32_t block)
+{
+    if(!dirty_blocks[block])
+    {
+        dirty_blocks[block] = 1;
+        dirty_count++;
+    }
+}
+
+void clearDirty()
+{
+    memset(dirty_blocks, 0, NUM_BLOCKS);
+    dirty_count = 0;
+}
+
+#define DELTA_MAGIC 0x4454464d  // "MFTD"
+
+struct deltaHeader
+{
+  uint32_t magic;
+  uint32_t since;
+  uint32_t generation;
+  uint32_t num_blocks;
+};
+
+// Number of owners beyond the first for every data block. Clones and snapshots share
+// blocks instead of copying them, so a block only goes back on the free block map when
+// its last owner lets go of it.
+uint16_t * block_shares;
+
+// A snapshot keeps a copy of the directory, free inode map and inode table (every block
+// before the free block map except the superblock) in ordinary data blocks, and holds a
+// share of every block that belonged to a file when it was taken.
+#define MAX_SNAPSHOTS 8
+#define SNAPSHOT_META_BLOCKS (FREE_BLOCK_MAP - 1)
+
+struct snapshot
+{
+  char name[64];
+  short in_use;
+  int64_t time;
+  int32_t blocks[SNAPSHOT_META_BLOCKS];
+};
+
+struct snapshot * snapshots;
+
+#define MAX_WORKER_THREADS 8
+
 char image_name[64];
 uint8_t image_open;
 
@@ -85,20 +204,210 @@ uint8_t image_open;
 #define MAX_NUM_ARGUMENTS 12    // Mav shell only supports 10 arguments
 #define MAX_HISTORY_SIZE 15     // Mav shell supports history of size 15
 
+// Slice-by-8 tables for the CRC32C (Castagnoli) polynomial, filled in by init()
+uint32_t crc_table[8][256];
+
+void initCrcTable()
+{
+    int i, j;
+    for(i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for(j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc_table[0][i] = crc;
+    }
+
+    for(i = 0; i < 256; i++)
+    {
+        for(j = 1; j < 8; j++)
+        {
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+        }
+    }
+}
+
+// Portable CRC32C that consumes eight bytes per table round
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t * buf, size_t len)
+{
+    crc = ~crc;
+
+    while(len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        word ^= crc;
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+        buf += 8;
+        len -= 8;
+    }
+
+    while(len--)
+    {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xff];
+    }
+
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// CRC32C using the SSE4.2 crc32 instruction, only called when the CPU has it
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const uint8_t * buf, size_t len)
+{
+    uint64_t crc64 = ~crc;
+
+    while(len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    uint32_t crc32 = (uint32_t) crc64;
+    while(len--)
+    {
+        crc32 = _mm_crc32_u8(crc32, *buf++);
+    }
+
+    return ~crc32;
+}
+#endif
+
+uint32_t (*crc32c)(uint32_t crc, const uint8_t * buf, size_t len) = crc32cSoftware;
+
+// Recompute the stored checksum after a data block changes
+void updateChecksum(int32_t block)
+{
+    block_crcs[block] = crc32c(0, data[block], BLOCK_SIZE);
+    block_gens[block] = superblock->generation + 1;
+    markDirty(block);
+}
+
+// Return 0 if the data block still matches its stored checksum
+int verifyBlock(int32_t block)
+{
+    if(block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS)
+    {
+        return -1;
+    }
+    return crc32c(0, data[block], BLOCK_SIZE) != block_crcs[block];
+}
+
+// Checksum everything from the directory to the end of the checksum table, skipping
+// the superblock that the result is stored in
+uint32_t metadataChecksum()
+{
+    uint32_t crc = crc32c(0, &data[0][0], SUPERBLOCK * BLOCK_SIZE);
+    return crc32c(crc, &data[SUPERBLOCK + 1][0],
+                  (FIRST_DATA_BLOCK - SUPERBLOCK - 1) * BLOCK_SIZE);
+}
+
+// Result of the command being run, 0 unless it reported an error. Recorded in traces.
+int command_status;
+
+// What the program exits with. Commands given with -c make it 1 if any of them failed.
+int exit_status;
+
+// Print an error message for the command being run and mark it as failed
+void printError(const char * format, ...)
+{
+    va_list args;
+    command_status = 1;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
 int32_t findFreeBlock()
 {
+  // free_blocks is indexed by block number, the same way delete and df use it
   int i;
-  for(i = 0; i < NUM_BLOCKS; i++)
+  for(i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
   {
     if(free_blocks[i])
     {
       free_blocks[i] = 0;
-      return i + 1001;
+      return i;
     }
   }
   return -1;
 }
 
+// Drop one owner of a data block, freeing it when nobody else shares it
+void releaseBlock(int32_t block)
+{
+    if(block_shares[block])
+    {
+        block_shares[block]--;
+    }
+    else
+    {
+        free_blocks[block] = 1;
+    }
+}
+
+// Add an owner to a data block, claiming it again if it had been freed
+void retainBlock(int32_t block)
+{
+    if(free_blocks[block])
+    {
+        free_blocks[block] = 0;
+    }
+    else
+    {
+        block_shares[block]++;
+    }
+}
+
+// Make block j of the inode private before it is modified. A shared block is copied to
+// a new block that replaces it in the inode. Returns the block to write to, or -1 if
+// no free block is left for the copy.
+int32_t cowBlock(int32_t inode, int j)
+{
+    int32_t block = inodes[inode].blocks[j];
+    if(block_shares[block] == 0)
+    {
+        return block;
+    }
+
+    int32_t copy = findFreeBlock();
+    if(copy == -1)
+    {
+        return -1;
+    }
+
+    memcpy(data[copy], data[block], BLOCK_SIZE);
+    block_crcs[copy] = block_crcs[block];
+    block_gens[copy] = superblock->generation + 1;
+    markDirty(copy);
+    block_shares[block]--;
+    inodes[inode].blocks[j] = copy;
+    return copy;
+}
+
+// Count the shared blocks in [first, last) of an inode, i.e. the copies a write needs
+int sharedBlocks(int32_t inode, int first, int last)
+{
+    int count = 0;
+    int j;
+    for(j = first; j < last; j++)
+    {
+        if(block_shares[inodes[inode].blocks[j]])
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
 int32_t findFreeInode()
 {
   int i;
@@ -113,58 +422,131 @@ int32_t findFreeInode()
   return -1;
 }
 
-int32_t findFreeInodeBlock( int32_t inode)
+// Return the directory slot holding filename, or -1 if no in-use entry has that name
+int findDirectoryEntry(char * filename)
 {
     int i;
-    for(i = 0; i < BLOCKS_PER_FILE; i++)
+    for(i = 0; i < NUM_FILES; i++)
     {
-        if(inodes[inode].blocks[i] == -1)
+        if(directory[i].in_use && !strcmp(filename, directory[i].filename))
         {
-            inodes[inode].blocks[i] = 0;
             return i;
         }
     }
     return -1;
 }
 
-void init()
+// Return a directory slot for a new file, or -1 if every slot holds a live file. Slots
+// that were never used come first so deleted files can be undeleted for as long as
+// possible. Taking a deleted file's slot gives it up for good, along with the inode it
+// was keeping for the undelete.
+int findFreeDirectoryEntry()
 {
-    directory   = (struct directoryEntry*)&data[0][0];
-    inodes      = (struct inode *)&data[20][0];
-    free_blocks = (uint8_t *)&data[1000][0];
-    free_inodes = (uint8_t *)&data[19][0]; 
+    int i;
+    int deleted = -1;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(!directory[i].in_use)
+        {
+            if(directory[i].filename[0] == '\0')
+            {
+                return i;
+            }
+            if(deleted == -1)
+            {
+                deleted = i;
+            }
+        }
+    }
 
-    memset(image_name, 0, 64);
-    image_open = 0;
-    
+    if(deleted != -1)
+    {
+        int32_t inode = directory[deleted].inode;
+        if(inode >= 0 && inode < NUM_FILES)
+        {
+            free_inodes[inode] = 1;
+        }
+        memset(directory[deleted].filename, 0, 64);
+    }
+    return deleted;
+}
 
-    int i;   
-    for(i = 0; i < NUM_FILES; i++)
+// Secondary indexes over the live files, each an array of directory slots: by name,
+// by size and by modification time. They are rebuilt on the first query after any
+// change to the directory or an inode.
+int name_index[NUM_FILES];
+int size_index[NUM_FILES];
+int mtime_index[NUM_FILES];
+int index_count;
+int indexes_valid;
+
+void invalidateIndexes()
+{
+    indexes_valid = 0;
+}
+
+// Stamp the inode with the current time
+void setInodeTime(int32_t inode)
+{
+    inodes[inode].mtime = time(0);
+    invalidateIndexes();
+}
+
+// Return the whole image to zeroed pages, falling back to memset if the kernel refuses
+void clearImage()
+{
+    if(madvise(data, NUM_BLOCKS * BLOCK_SIZE, MADV_DONTNEED))
     {
-        
-        directory[i].in_use = 0;
-        directory[i].inode = -1;
-        free_inodes[i] = 1;
+        memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
+    }
+}
 
-        memset(directory[i].filename, 0, 64);
+// Mark every inode and block free. Everything else in an empty image is zero.
+void initFreeMaps()
+{
+    memset(free_inodes, 1, NUM_FILES);
+    memset(free_blocks, 1, NUM_BLOCKS);
+}
 
-        int j;
-        for(j = 0; j < NUM_BLOCKS; j++)
-        {
-            inodes[i].blocks[j] = -1;
-            inodes[i].in_use = 0; 
-            inodes[i].attribute = 0;
-            inodes[i].file_size = 0;
+// Point the metadata tables into the image in data[]
+void setImagePointers()
+{
+    directory   = (struct directoryEntry*)&data[0][0];
+    inodes      = (struct inode *)&data[FIRST_INODE_BLOCK][0];
+    free_blocks = (uint8_t *)&data[FREE_BLOCK_MAP][0];
+    free_inodes = (uint8_t *)&data[FREE_INODE_BLOCK][0]; 
+    superblock  = (struct superblock *)&data[SUPERBLOCK][0];
+    block_crcs  = (uint32_t *)&data[CHECKSUM_BLOCK][0];
+    block_shares = (uint16_t *)&data[SHARE_BLOCK][0];
+    block_gens  = (uint32_t *)&data[GENERATION_BLOCK][0];
+    meta_crcs   = (uint32_t *)&data[META_CRC_BLOCK][0];
+    snapshots   = (struct snapshot *)&data[SNAPSHOT_BLOCK][0];
+}
 
-        }
-        
+void init()
+{
+    data = mmap(NULL, NUM_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED)
+    {
+        perror("Allocating the disk image failed");
+        exit(1);
     }
-    int j;
-    for(int j = 0; j < NUM_BLOCKS; j++)
+    private_data = data;
+    setImagePointers();
+
+    initCrcTable();
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("sse4.2"))
     {
-        free_blocks[j] = 1;
+        crc32c = crc32cHardware;
     }
+#endif
+
+    memset(image_name, 0, 64);
+    image_open = 0;
 
+    initFreeMaps();
 }
 
 uint32_t df()
@@ -183,595 +565,4098 @@ uint32_t df()
 
 
 
-void createfs(char * filename)
+// The background flusher. Commands run with fs_lock held, and the flusher only takes
+// it long enough to copy the metadata and the dirty data blocks, then writes that copy
+// to the image while commands carry on.
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flush_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+pthread_t flusher_thread;
+int flusher_running;
+int flusher_fds[MAX_WORKER_THREADS];
+int flush_interval;             // seconds between flushes
+uint32_t flush_threshold;       // dirty bytes that trigger an early flush, 0 for none
+uint64_t flush_requested;       // barrier tickets handed out
+uint64_t flush_completed;       // highest ticket covered by a finished flush
+uint64_t flush_failed;          // highest ticket answered by a failed flush
+uint32_t flushed_metadata_crc;
+
+// Set by --direct. Image files are opened with O_DIRECT so they bypass the page cache,
+// which would otherwise hold a second copy of data[]. Filesystems that refuse it and
+// transfers it can not align fall back to buffered I/O.
+int direct_io;
+
+// Turn O_DIRECT off on fd after the kernel rejected a transfer. Returns 1 if it was on.
+int dropDirect(int fd)
 {
-  fp = fopen(filename, "w");
-
-  strncpy(image_name, filename, strlen(filename));
-
-  memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
-  
-  image_open = 1;
-  
-  int i;
-  for(i = 0; i< NUM_FILES; i++)
-  {
-    
-    directory[i].in_use = 0;
-    directory[i].inode = 1;
-    free_inodes[i] = 1;
-
-    memset(directory[i].filename, 0, 64);
-
-    int j;
-    for(j = 0; j < NUM_BLOCKS; j++)
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || !(flags & O_DIRECT))
     {
-        inodes[i].blocks[j] = -1;
-        inodes[i].in_use = 0;
-        inodes[i].attribute = 0;
-        inodes[i].file_size = 0;
+        return 0;
     }
-  }
+    return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+}
 
-  int j;
-  for(j = 0; j < NUM_BLOCKS; j++)
-  {
-    free_blocks[j] = 1;
-  }
+// Write all of len bytes to fd at offset
+int pwriteAll(int fd, const uint8_t * buf, size_t len, off_t offset)
+{
+    while(len > 0)
+    {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if(written < 0)
+        {
+            if(errno == EINTR || (errno == EINVAL && dropDirect(fd)))
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
 }
 
-void savefs()
+// Read up to len bytes from fd at offset. Returns the number read, which is short
+// only at the end of the file, or -1.
+ssize_t preadAll(int fd, uint8_t * buf, size_t len, off_t offset)
 {
-  if(image_open == 0)
-  {
-    printf("ERROR: Disk img not open\n");
-  }
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t got = pread(fd, buf + done, len - done, offset + done);
+        if(got < 0)
+        {
+            if(errno == EINTR || (errno == EINVAL && dropDirect(fd)))
+            {
+                continue;
+            }
+            return -1;
+        }
+        if(got == 0)
+        {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
 
-  fp = fopen(image_name, "w");
+// An image can be striped over member files <name>.0 to <name>.N-1 so its I/O is
+// spread over several disks. Logical blocks go round-robin to the members in chunks of
+// stripe_chunk blocks, and the file <name> itself only records the geometry. A plain
+// image is a single member, the file itself, holding every block in one chunk.
+#define STRIPE_MAGIC "mfs-stripe"
+#define MAX_STRIPES MAX_WORKER_THREADS     // each member gets its own I/O thread
+#define DEFAULT_STRIPE_CHUNK 64
 
-  fwrite( &data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-  memset(image_name, 0, 64);
-}
+int stripe_count = 1;
+int stripe_chunk = NUM_BLOCKS;
 
-void openfs(char * filename)
-{    
-  fp = fopen(filename, "r");
-  
-  strncpy(image_name, filename, strlen(filename));
+// Offset of a logical block within the member that holds it, for an image striped over
+// stripes members in chunks of chunk_size blocks
+off_t stripeLayoutOffset(int32_t block, int stripes, int chunk_size, int * member)
+{
+    int32_t chunk = block / chunk_size;
+    *member = chunk % stripes;
+    return ((off_t)(chunk / stripes) * chunk_size + block % chunk_size) * BLOCK_SIZE;
+}
 
-  fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
+// The same for the current image
+off_t stripeOffset(int32_t block, int * member)
+{
+    return stripeLayoutOffset(block, stripe_count, stripe_chunk, member);
+}
 
-  image_open = 1;
+// Bytes a member holds once the whole image has been written
+off_t memberSize(int member)
+{
+    off_t size = 0;
+    int32_t first;
+    for(first = member * stripe_chunk; first < NUM_BLOCKS;
+        first += stripe_count * stripe_chunk)
+    {
+        size += (NUM_BLOCKS - first < stripe_chunk ? NUM_BLOCKS - first : stripe_chunk);
+    }
+    return size * BLOCK_SIZE;
 }
 
-void closefs()
+// Name of a member of the image called name, striped over stripes files
+void stripeMemberPath(char * name, int stripes, int member, char * path, size_t size)
 {
-  if (image_open == 0)
-  {
-    printf("ERROR: Disk image is not open\n");
-    return;
-  }
+    if(stripes == 1)
+    {
+        snprintf(path, size, "%s", name);
+    }
+    else
+    {
+        snprintf(path, size, "%s.%d", name, member);
+    }
+}
 
-  fclose(fp);
-  
-  image_open = 0; 
-  memset(image_name, 0, 64);
-  memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
+void memberPath(int member, char * path, size_t size)
+{
+    stripeMemberPath(image_name, stripe_count, member, path, size);
 }
 
-void list(char * attrib)
+// Open every member of the current image. Returns 0, or -1 with none of them open.
+int openMembers(int flags, int * fds)
 {
+    char path[80];
     int i;
-    int not_found = 1;
-    
-    for(i = 0; i < NUM_FILES; i++)
+    for(i = 0; i < stripe_count; i++)
     {
-
-        if(directory[i].in_use)
+        memberPath(i, path, sizeof(path));
+        fds[i] = open(path, flags | (direct_io ? O_DIRECT : 0), 0644);
+        if(fds[i] == -1 && direct_io && errno == EINVAL)
         {
-            not_found=0;
-            char filename[65];
-            memset(filename, 0, 65);
-            strncpy(filename, directory[i].filename, strlen(directory[i].filename));
-
-            if(inodes[directory[i].inode].hr < 0)
-            {
-                inodes[directory[i].inode].hr += 24;
-            }
-            if(inodes[directory[i].inode].hr > 12)
-            {
-                inodes[directory[i].inode].hr = inodes[i].hr % 12;
-            }
-
-            if(!strcmp(attrib, "-h"))
-            {
-                printf("%s   %d   %02d:%02d:%02d\n",filename,inodes[directory[i].inode].file_size,
-                inodes[directory[i].inode].hr, inodes[directory[i].inode].min,
-                inodes[directory[i].inode].sec);
-            }
-            else if(!strcmp(attrib, "-a"))
-            {
-                printf("%s   %d   %02d:%02d:%02d   ",filename,inodes[directory[i].inode].file_size,
-                inodes[directory[i].inode].hr, inodes[directory[i].inode].min, 
-                inodes[directory[i].inode].sec);
-                for (int j = 7; j >= 0; j--) 
-                {
-                    printf("%d", (inodes[directory[i].inode].attribute >> j) & 1);
-                }
-                printf("\n");
-            }
-            else
+            fds[i] = open(path, flags, 0644);
+        }
+        if(fds[i] == -1)
+        {
+            perror(path);
+            while(i--)
             {
-                if(inodes[directory[i].inode].attribute != 1)
-                {
-                    printf("%s   %d   %02d:%02d:%02d\n",filename,inodes[directory[i].inode].file_size,
-                    inodes[directory[i].inode].hr, inodes[directory[i].inode].min,
-                    inodes[directory[i].inode].sec);
-                }
+                close(fds[i]);
             }
+            return -1;
         }
     }
-    if(not_found)
-    {
-        printf("ERROR: No file found\n");
-    }
+    return 0;
 }
 
-void insert (char* filename)
+void closeMembers(int * fds)
+{
+    int i;
+    for(i = 0; i < stripe_count; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+// Write count logical blocks starting at first, splitting the run where it crosses
+// from one chunk, and so one member, to the next
+int writeBlocks(int * fds, const uint8_t * buf, int32_t first, int count)
+{
+    while(count > 0)
+    {
+        int member;
+        off_t offset = stripeOffset(first, &member);
+        int run = stripe_chunk - first % stripe_chunk;
+        if(run > count)
+        {
+            run = count;
+        }
+        if(pwriteAll(fds[member], buf, (size_t) run * BLOCK_SIZE, offset))
+        {
+            return -1;
+        }
+        buf += (size_t) run * BLOCK_SIZE;
+        first += run;
+        count -= run;
+    }
+    return 0;
+}
+
+// Several processes can use one image: one writer, which has it open as usual, and any
+// number of readers that open it with --shared and map its files read-only, so they
+// share the host's page cache. The processes coordinate with open file description
+// locks on the image's first file, held through lock_fd so opening and closing other
+// descriptors for the file does not drop them. Byte 0 is the writer lease, held for as
+// long as a process has the image open for writing. Byte 1 is the data lock, held
+// shared by readers while they run a command and exclusively by the writer while it
+// changes the file.
+#define WRITER_LEASE 0
+#define DATA_LOCK 1
+
+int lock_fd = -1;
+int image_shared;
+int holding_data_lock;
+
+int imageLock(int fd, int byte, short type, int wait)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = byte;
+    lock.l_len = 1;
+
+    int result;
+    while((result = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock)) == -1 &&
+          errno == EINTR);
+    return result;
+}
+
+// Take or drop the data lock of the current image. Returns 0, or -1 if the image has
+// no lock file or the lock could not be taken.
+int lockImageData(short type)
+{
+    if(lock_fd == -1)
+    {
+        printf("The image has no lock file.\n");
+        return -1;
+    }
+    if(imageLock(lock_fd, DATA_LOCK, type, 1))
+    {
+        perror("Locking the image returned");
+        return -1;
+    }
+    return 0;
+}
+
+// Go back to the private copy of the image after a shared one
+void unshareImage()
+{
+    if(!image_shared)
+    {
+        return;
+    }
+
+    munmap(data, NUM_BLOCKS * BLOCK_SIZE);
+    data = private_data;
+    setImagePointers();
+    image_shared = 0;
+}
+
+// Leave no image open: drop the shared mapping and the lock file and empty data[]
+void releaseImage()
+{
+    unshareImage();
+
+    if(lock_fd != -1)
+    {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+    holding_data_lock = 0;
+
+    image_open = 0;
+    memset(image_name, 0, 64);
+    clearImage();
+    invalidateIndexes();
+}
+
+// Open the lock file of the image called filename, and take the writer lease unless
+// it is opened for reading. Returns the descriptor, -1 if the file can't be opened and
+// -2 if another process holds the lease.
+int takeImageLock(char * filename, int writer, int create)
+{
+    int fd = open(filename, writer ? O_RDWR | (create ? O_CREAT : 0) : O_RDONLY, 0644);
+    if(fd == -1)
+    {
+        return -1;
+    }
+    if(writer && imageLock(fd, WRITER_LEASE, F_WRLCK, 0))
+    {
+        close(fd);
+        return -2;
+    }
+    return fd;
+}
+
+// Move the lock over to the image called filename. A writer lets go of the current
+// image's lease first, since it may be the same file, and takes it back if the new one
+// can't be had. If that fails too the current image is closed. Returns 0, or -1 after
+// reporting why.
+int switchImageLock(char * filename, int writer, int create)
+{
+    if(writer && lock_fd != -1)
+    {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+
+    int fd = takeImageLock(filename, writer, create);
+    if(fd >= 0)
+    {
+        if(lock_fd != -1)
+        {
+            close(lock_fd);
+        }
+        lock_fd = fd;
+        holding_data_lock = 0;
+        return 0;
+    }
+
+    if(fd == -2)
+    {
+        printError("ERROR: %s is open for writing in another process.\n", filename);
+    }
+    else
+    {
+        printError("open: File not found\n");
+    }
+    if(image_open && lock_fd == -1)
+    {
+        lock_fd = takeImageLock(image_name, !image_shared, 0);
+        if(lock_fd < 0)
+        {
+            lock_fd = -1;
+            printError("ERROR: The lease on %s was lost, the image has been closed.\n",
+                       image_name);
+            releaseImage();
+        }
+    }
+    return -1;
+}
+
+// Write the metadata and every dirty data block to the image. Called with fs_lock held;
+// the lock is dropped while the copy is written out and held again on return. Returns
+// 0 once everything is on disk.
+int flushOnce()
+{
+    superblock->magic = FS_MAGIC;
+    superblock->metadata_crc = metadataChecksum();
+
+    int count = FIRST_DATA_BLOCK + dirty_count;
+    // Page aligned so the writes can go straight to the disk with --direct
+    uint8_t * staging = NULL;
+    if(posix_memalign((void **) &staging, 4096, (size_t) count * BLOCK_SIZE))
+    {
+        staging = NULL;
+    }
+    int32_t * numbers = (int32_t *) malloc(count * sizeof(int32_t));
+    if(staging == NULL || numbers == NULL)
+    {
+        fprintf(stderr, "flusher: Out of memory\n");
+        free(staging);
+        free(numbers);
+        return -1;
+    }
+
+    // Snapshot everything in block order so neighbouring blocks go out in one write
+    memcpy(staging, &data[0][0], (size_t) FIRST_DATA_BLOCK * BLOCK_SIZE);
+    int k = 0;
+    int32_t block;
+    for(block = 0; block < FIRST_DATA_BLOCK; block++)
+    {
+        numbers[k++] = block;
+    }
+    for(block = FIRST_DATA_BLOCK; block < NUM_BLOCKS; block++)
+    {
+        if(dirty_blocks[block])
+        {
+            memcpy(&staging[(size_t) k * BLOCK_SIZE], data[block], BLOCK_SIZE);
+            numbers[k++] = block;
+        }
+    }
+    clearDirty();
+    flushed_metadata_crc = superblock->metadata_crc;
+
+    pthread_mutex_unlock(&fs_lock);
+
+    // Readers of the image must not see it half written
+    int failed = lockImageData(F_WRLCK) != 0;
+    int locked = !failed;
+    int run, next;
+    for(run = 0; run < k && !failed; run = next)
+    {
+        for(next = run + 1; next < k && numbers[next] == numbers[next - 1] + 1; next++);
+        failed = writeBlocks(flusher_fds, &staging[(size_t) run * BLOCK_SIZE], numbers[run],
+                             next - run);
+    }
+    for(run = 0; run < stripe_count && !failed; run++)
+    {
+        failed = fdatasync(flusher_fds[run]);
+    }
+
+    if(locked)
+    {
+        lockImageData(F_UNLCK);
+    }
+
+    pthread_mutex_lock(&fs_lock);
+
+    if(failed)
+    {
+        // Leave the data blocks dirty so the next flush tries them again
+        perror("flusher: Writing the image failed");
+        for(run = FIRST_DATA_BLOCK; run < k; run++)
+        {
+            markDirty(numbers[run]);
+        }
+        flushed_metadata_crc = 0;
+    }
+
+    free(staging);
+    free(numbers);
+    return failed ? -1 : 0;
+}
+
+int flushDue()
+{
+    // Barriers still waiting for an answer, good or bad
+    uint64_t answered = flush_completed > flush_failed ? flush_completed : flush_failed;
+    return flush_requested > answered ||
+           (flush_threshold && (uint64_t) dirty_count * BLOCK_SIZE >= flush_threshold);
+}
+
+void * flusherMain(void * arg)
+{
+    pthread_mutex_lock(&fs_lock);
+    while(flusher_running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval;
+
+        while(flusher_running && !flushDue())
+        {
+            if(pthread_cond_timedwait(&flush_wake, &fs_lock, &deadline) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+
+        // Nothing to do if no barrier is waiting and nothing changed
+        if(!flushDue() && dirty_count == 0 && metadataChecksum() == flushed_metadata_crc)
+        {
+            continue;
+        }
+
+        uint64_t target = flush_requested;
+        if(flushOnce() == 0)
+        {
+            flush_completed = target;
+        }
+        else
+        {
+            flush_failed = target;
+        }
+        pthread_cond_broadcast(&flush_done);
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return NULL;
+}
+
+// Wait until a flush that started after this call has finished. Called with fs_lock
+// held, which the wait gives up so the flusher can take its copy. Returns 0 if the
+// flush got everything to disk and -1 if it failed.
+int flusherBarrier()
+{
+    uint64_t ticket = ++flush_requested;
+    pthread_cond_signal(&flush_wake);
+    while(flush_completed < ticket && flush_failed < ticket)
+    {
+        pthread_cond_wait(&flush_done, &fs_lock);
+    }
+    return flush_completed >= ticket ? 0 : -1;
+}
+
+// Start flushing the open image every interval seconds, or sooner once threshold dirty
+// bytes pile up. A running flusher just takes the new settings.
+void startFlusher(int interval, uint32_t threshold)
+{
+    flush_interval = interval;
+    flush_threshold = threshold;
+
+    if(flusher_running)
+    {
+        pthread_cond_signal(&flush_wake);
+        return;
+    }
+
+    if(openMembers(O_RDWR, flusher_fds))
+    {
+        printf("flusher: Opening the image failed\n");
+        return;
+    }
+
+    // Blocks the flusher never writes must read back as zeros
+    int i;
+    for(i = 0; i < stripe_count; i++)
+    {
+        struct stat buf;
+        if(fstat(flusher_fds[i], &buf) == 0 && buf.st_size < memberSize(i))
+        {
+            if(ftruncate(flusher_fds[i], memberSize(i)))
+            {
+                perror("flusher: Sizing the image failed");
+            }
+        }
+    }
+
+    flushed_metadata_crc = 0;
+    flusher_running = 1;
+    if(pthread_create(&flusher_thread, NULL, flusherMain, NULL))
+    {
+        printError("ERROR: Could not start the flusher thread.\n");
+        flusher_running = 0;
+        closeMembers(flusher_fds);
+    }
+}
+
+// Flush everything one last time and stop the flusher thread
+void stopFlusher()
+{
+    if(!flusher_running)
+    {
+        return;
+    }
+
+    if(flusherBarrier())
+    {
+        printError("ERROR: The last flush failed, the image on disk is out of date.\n");
+    }
+    flusher_running = 0;
+    pthread_cond_signal(&flush_wake);
+
+    pthread_mutex_unlock(&fs_lock);
+    pthread_join(flusher_thread, NULL);
+    pthread_mutex_lock(&fs_lock);
+
+    closeMembers(flusher_fds);
+}
+
+// Create an empty image. With stripes above 1 it is striped over that many member
+// files in chunks of chunk blocks.
+void createfs(char * filename, int stripes, int chunk)
+{
+  stopFlusher();
+
+  if(switchImageLock(filename, 1, 1))
+  {
+    return;
+  }
+  unshareImage();
+
+  memset(image_name, 0, 64);
+  strncpy(image_name, filename, 63);
+  stripe_count = stripes > 1 ? stripes : 1;
+  stripe_chunk = stripes > 1 ? chunk : NUM_BLOCKS;
+
+  // Readers may have the files mapped, so they are emptied under the data lock and
+  // given their full size again before anybody can touch a page past the end
+  if(lockImageData(F_WRLCK))
+  {
+    printError("ERROR: Could not lock %s\n", filename);
+    releaseImage();
+    return;
+  }
+
+  if(stripes > 1)
+  {
+    FILE * manifest = fopen(filename, "w");
+    if(manifest == NULL)
+    {
+      perror(filename);
+      command_status = 1;
+    }
+    else
+    {
+      fprintf(manifest, STRIPE_MAGIC " %d %d\n", stripes, chunk);
+      fclose(manifest);
+    }
+  }
+
+  int fds[MAX_STRIPES];
+  if(openMembers(O_WRONLY | O_CREAT | O_TRUNC, fds) == 0)
+  {
+    int i;
+    for(i = 0; i < stripe_count; i++)
+    {
+      if(ftruncate(fds[i], memberSize(i)))
+      {
+        perror("Sizing the image returned");
+        command_status = 1;
+      }
+    }
+    closeMembers(fds);
+  }
+  else
+  {
+    command_status = 1;
+  }
+
+  lockImageData(F_UNLCK);
+
+  clearImage();
+  clearDirty();
+  invalidateIndexes();
+  
+  image_open = 1;
+
+  // A zeroed directory and inode table are already empty, only the free maps need filling
+  initFreeMaps();
+
+  superblock->magic = FS_MAGIC;
+}
+
+// Pick how many threads to split items over, giving each at least min_items
+int workerCount(int items, int min_items)
+{
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_threads > MAX_WORKER_THREADS)
+    {
+        num_threads = MAX_WORKER_THREADS;
+    }
+    if(num_threads > items / min_items)
+    {
+        num_threads = items / min_items;
+    }
+    if(num_threads < 1)
+    {
+        num_threads = 1;
+    }
+    return num_threads;
+}
+
+// Run worker once for each of the num_threads argument structs in args, arg_size bytes
+// apart, and wait for all of them. The calling thread does the first share itself and
+// picks up any share a thread could not be started for.
+void runWorkers(void * (*worker)(void *), void * args, size_t arg_size, int num_threads)
+{
+    pthread_t threads[MAX_WORKER_THREADS];
+    int started = 1;
+    int i;
+
+    for(i = 1; i < num_threads; i++)
+    {
+        if(pthread_create(&threads[i], NULL, worker, (uint8_t *) args + i * arg_size))
+        {
+            break;
+        }
+        started++;
+    }
+    worker(args);
+    for(i = started; i < num_threads; i++)
+    {
+        worker((uint8_t *) args + i * arg_size);
+    }
+    for(i = 1; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Work handed to one scrub thread: a slice of the list of blocks owned by files
+struct scrubRange
+{
+  int start;
+  int end;
+};
+
+int32_t scrub_list[NUM_BLOCKS];
+uint8_t scrub_bad[NUM_BLOCKS];
+
+void * scrubWorker(void * arg)
+{
+    struct scrubRange * range = (struct scrubRange *) arg;
+    int k;
+    for(k = range->start; k < range->end; k++)
+    {
+        scrub_bad[k] = verifyBlock(scrub_list[k]) != 0;
+    }
+    return NULL;
+}
+
+// Check every block owned by a file against its checksum, spreading the blocks over
+// several threads. Files with bad blocks are always reported; the totals are only
+// printed when quiet is 0. Returns the number of bad blocks found.
+int scrub(int quiet)
+{
+    int file_start[NUM_FILES + 1];
+    int count = 0;
+    int i, j;
+
+    // Flatten the blocks of every file into one list so the threads get even shares
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        file_start[i] = count;
+        if(directory[i].in_use)
+        {
+            int32_t inode = directory[i].inode;
+            int num_blocks = (inodes[inode].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for(j = 0; j < num_blocks && j < BLOCKS_PER_FILE && count < NUM_BLOCKS; j++)
+            {
+                scrub_list[count++] = inodes[inode].blocks[j];
+            }
+        }
+    }
+    file_start[NUM_FILES] = count;
+
+    int num_threads = workerCount(count, BLOCKS_PER_FILE);
+    struct scrubRange ranges[MAX_WORKER_THREADS];
+    for(i = 0; i < num_threads; i++)
+    {
+        ranges[i].start = (int)((int64_t) count * i / num_threads);
+        ranges[i].end = (int)((int64_t) count * (i + 1) / num_threads);
+    }
+
+    runWorkers(scrubWorker, ranges, sizeof(struct scrubRange), num_threads);
+
+    int bad_blocks = 0;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        int bad = 0;
+        for(j = file_start[i]; j < file_start[i + 1]; j++)
+        {
+            bad += scrub_bad[j];
+        }
+        if(bad)
+        {
+            printf("scrub: %s has %d corrupt block(s)\n", directory[i].filename, bad);
+            bad_blocks += bad;
+        }
+    }
+
+    if(!quiet)
+    {
+        printf("scrub: %d blocks checked, %d corrupt\n", count, bad_blocks);
+    }
+    return bad_blocks;
+}
+
+// Recompute the checksum of every block owned by a file. Used for images written
+// before block checksums existed.
+void rebuildChecksums()
+{
+    int i, j;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(directory[i].in_use)
+        {
+            int32_t inode = directory[i].inode;
+            int num_blocks = (inodes[inode].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for(j = 0; j < num_blocks && j < BLOCKS_PER_FILE; j++)
+            {
+                int32_t block = inodes[inode].blocks[j];
+                if(block >= FIRST_DATA_BLOCK && block < NUM_BLOCKS)
+                {
+                    updateChecksum(block);
+                }
+            }
+        }
+    }
+    superblock->magic = FS_MAGIC;
+}
+
+// The generation and metadata CRC tables only describe other blocks, so they are not
+// stamped themselves; a delta includes their blocks whenever an entry in them changed
+int derivedMetadataBlock(int32_t block)
+{
+    return block == SUPERBLOCK ||
+           (block >= GENERATION_BLOCK && block < META_CRC_BLOCK + META_CRC_BLOCKS);
+}
+
+// Stamp every metadata block whose contents changed since the last save or export
+// with the working generation
+void stampMetadata()
+{
+    int32_t block;
+    for(block = 0; block < FIRST_DATA_BLOCK; block++)
+    {
+        if(derivedMetadataBlock(block))
+        {
+            continue;
+        }
+
+        uint32_t crc = crc32c(0, data[block], BLOCK_SIZE);
+        if(crc != meta_crcs[block])
+        {
+            meta_crcs[block] = crc;
+            block_gens[block] = superblock->generation + 1;
+        }
+    }
+}
+
+// Stamp changed metadata and close the working generation if anything changed in it.
+// Closing an unchanged generation would put a fresh copy out of step with its source.
+void closeGeneration()
+{
+    stampMetadata();
+
+    int32_t block;
+    for(block = 0; block < NUM_BLOCKS; block++)
+    {
+        if(block_gens[block] > superblock->generation)
+        {
+            superblock->generation++;
+            return;
+        }
+    }
+}
+
+// Return 1 if block belongs in a delta of everything changed after generation since
+int changedSince(int32_t block, uint32_t since)
+{
+    if(block == SUPERBLOCK)
+    {
+        return 1;
+    }
+
+    // A table block changed if any entry in it did
+    int32_t first = -1;
+    if(block >= GENERATION_BLOCK && block < META_CRC_BLOCK)
+    {
+        first = (block - GENERATION_BLOCK) * (BLOCK_SIZE / sizeof(uint32_t));
+    }
+    else if(block >= META_CRC_BLOCK && block < META_CRC_BLOCK + META_CRC_BLOCKS)
+    {
+        first = (block - META_CRC_BLOCK) * (BLOCK_SIZE / sizeof(uint32_t));
+    }
+
+    if(first != -1)
+    {
+        int k;
+        for(k = 0; k < BLOCK_SIZE / sizeof(uint32_t) && first + k < NUM_BLOCKS; k++)
+        {
+            if(block_gens[first + k] > since && !derivedMetadataBlock(first + k))
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    return block_gens[block] > since;
+}
+
+// Close the working generation and write every block changed after generation since
+// to outputfname ("-" for stdout). Applying the result to a copy of the image saved at
+// generation since brings it up to the generation written here.
+void exportDelta(uint32_t since, char * outputfname)
+{
+    if(since > superblock->generation)
+    {
+        printError("ERROR: Generation %u is newer than the image (%u).\n", since,
+               superblock->generation);
+        return;
+    }
+
+    int to_stdout = !strcmp(outputfname, "-");
+    FILE * ofp = to_stdout ? stdout : fopen(outputfname, "w");
+    if(ofp == NULL)
+    {
+        printError("Could not open output file: %s\n", outputfname);
+        perror("Opening output file returned");
+        return;
+    }
+    FILE * msg = to_stdout ? stderr : stdout;
+
+    // A shared image was closed and stamped when its writer saved it
+    if(!image_shared)
+    {
+        closeGeneration();
+        superblock->magic = FS_MAGIC;
+        superblock->metadata_crc = metadataChecksum();
+    }
+
+    struct deltaHeader header;
+    header.magic = DELTA_MAGIC;
+    header.since = since;
+    header.generation = superblock->generation;
+    header.num_blocks = 0;
+
+    int32_t block;
+    for(block = 0; block < NUM_BLOCKS; block++)
+    {
+        header.num_blocks += changedSince(block, since);
+    }
+
+    fflush(stdout);
+    int failed = fwrite(&header, sizeof(header), 1, ofp) != 1;
+    for(block = 0; block < NUM_BLOCKS && !failed; block++)
+    {
+        if(changedSince(block, since))
+        {
+            uint32_t number = block;
+            failed = fwrite(&number, sizeof(number), 1, ofp) != 1 ||
+                     fwrite(data[block], BLOCK_SIZE, 1, ofp) != 1;
+        }
+    }
+
+    if(to_stdout)
+    {
+        fflush(stdout);
+    }
+    else if(fclose(ofp))
+    {
+        failed = 1;
+    }
+
+    if(failed)
+    {
+        command_status = 1;
+        fprintf(msg, "ERROR: Writing the delta failed.\n");
+        return;
+    }
+
+    fprintf(msg, "Exported %u blocks, generation %u to %u\n", header.num_blocks, since,
+            header.generation);
+}
+
+// Apply a delta written by exportDelta. The image must be at the generation the delta
+// was taken from. The whole delta is read before any of it is applied, so a truncated
+// delta leaves the image untouched.
+void importDelta(char * inputfname)
+{
+    int from_stdin = !strcmp(inputfname, "-");
+    FILE * ifp = from_stdin ? stdin : fopen(inputfname, "r");
+    if(ifp == NULL)
+    {
+        printError("ERROR: File does not exist.\n");
+        return;
+    }
+
+    struct deltaHeader header;
+    uint8_t * records = NULL;
+    size_t record_size = sizeof(uint32_t) + BLOCK_SIZE;
+
+    if(fread(&header, sizeof(header), 1, ifp) != 1 || header.magic != DELTA_MAGIC ||
+       header.num_blocks > NUM_BLOCKS)
+    {
+        printError("ERROR: %s is not a delta.\n", inputfname);
+    }
+    else if(header.since != superblock->generation)
+    {
+        printError("ERROR: Delta applies to generation %u but the image is at %u.\n",
+               header.since, superblock->generation);
+    }
+    else if((records = (uint8_t *) malloc(header.num_blocks * record_size + 1)) == NULL)
+    {
+        printError("ERROR: Out of memory.\n");
+    }
+    else if(fread(records, record_size, header.num_blocks, ifp) != header.num_blocks)
+    {
+        printError("ERROR: Delta is truncated.\n");
+        free(records);
+        records = NULL;
+    }
+
+    if(from_stdin)
+    {
+        clearerr(stdin);
+    }
+    else
+    {
+        fclose(ifp);
+    }
+
+    if(records == NULL)
+    {
+        return;
+    }
+
+    uint32_t k;
+    for(k = 0; k < header.num_blocks; k++)
+    {
+        uint32_t block;
+        memcpy(&block, &records[k * record_size], sizeof(block));
+        if(block < NUM_BLOCKS)
+        {
+            memcpy(data[block], &records[k * record_size + sizeof(block)], BLOCK_SIZE);
+            if(block >= FIRST_DATA_BLOCK)
+            {
+                markDirty(block);
+            }
+        }
+    }
+    free(records);
+    invalidateIndexes();
+
+    printf("Imported %u blocks, now at generation %u\n", header.num_blocks,
+           superblock->generation);
+
+    if(superblock->metadata_crc != metadataChecksum())
+    {
+        printf("WARNING: Metadata checksum mismatch, the image may be corrupt.\n");
+    }
+}
+
+struct memberTransfer
+{
+    int member;
+    int fd;
+    int write;
+    int failed;
+};
+
+// Move one member's chunks between the file and data[]. Blocks past the end of a
+// short file read as zeros.
+void * memberTransferWorker(void * arg)
+{
+    struct memberTransfer * transfer = (struct memberTransfer *) arg;
+    int32_t first;
+    for(first = transfer->member * stripe_chunk; first < NUM_BLOCKS && !transfer->failed;
+        first += stripe_count * stripe_chunk)
+    {
+        int member;
+        off_t offset = stripeOffset(first, &member);
+        size_t len = (size_t)(NUM_BLOCKS - first < stripe_chunk ? NUM_BLOCKS - first :
+                              stripe_chunk) * BLOCK_SIZE;
+        if(transfer->write)
+        {
+            transfer->failed = pwriteAll(transfer->fd, data[first], len, offset);
+        }
+        else
+        {
+            ssize_t got = preadAll(transfer->fd, data[first], len, offset);
+            if(got < 0)
+            {
+                transfer->failed = 1;
+            }
+            else
+            {
+                memset(&data[first][got], 0, len - got);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Read the whole image into data[], or write it out, with one thread per member.
+// Returns 0 on success.
+int transferImage(int write)
+{
+    int fds[MAX_STRIPES];
+    if(openMembers(write ? O_WRONLY | O_CREAT : O_RDONLY, fds))
+    {
+        return -1;
+    }
+
+    struct memberTransfer transfers[MAX_STRIPES];
+    int i;
+    for(i = 0; i < stripe_count; i++)
+    {
+        transfers[i].member = i;
+        transfers[i].fd = fds[i];
+        transfers[i].write = write;
+        transfers[i].failed = 0;
+    }
+    runWorkers(memberTransferWorker, transfers, sizeof(struct memberTransfer), stripe_count);
+
+    int failed = 0;
+    for(i = 0; i < stripe_count; i++)
+    {
+        failed |= transfers[i].failed;
+    }
+    if(failed)
+    {
+        perror("Transferring the image returned");
+    }
+    closeMembers(fds);
+    return failed ? -1 : 0;
+}
+
+// Write the image out. Returns 0 once it is on disk.
+int savefs()
+{
+  if(image_open == 0)
+  {
+    printError("ERROR: Disk img not open\n");
+    return -1;
+  }
+
+  // Saving closes the working generation
+  closeGeneration();
+
+  // With the flusher running, saving is a barrier on a flush of the current state
+  if(flusher_running)
+  {
+    if(flusherBarrier())
+    {
+      printError("ERROR: Flushing the image failed.\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  superblock->magic = FS_MAGIC;
+  superblock->metadata_crc = metadataChecksum();
+
+  // Readers must not see the image half written, and without the lock it isn't ours
+  if(lockImageData(F_WRLCK))
+  {
+    printError("ERROR: Could not lock the image, it was not saved.\n");
+    return -1;
+  }
+  int failed = transferImage(1);
+  lockImageData(F_UNLCK);
+
+  if(failed)
+  {
+    printError("ERROR: Writing the image failed.\n");
+    return -1;
+  }
+  clearDirty();
+  return 0;
+}
+
+// Read the geometry of the image named filename: a plain image is one stripe
+int readStripeGeometry(char * filename, int * stripes, int * chunk)
+{
+  struct stat buf;
+  if(stat(filename, &buf) == -1)
+  {
+    return -1;
+  }
+
+  *stripes = 1;
+  *chunk = NUM_BLOCKS;
+
+  // Only the small geometry file of a striped image can hold the magic line
+  FILE * ifp = buf.st_size < BLOCK_SIZE ? fopen(filename, "r") : NULL;
+  if(ifp)
+  {
+    int count, size;
+    if(fscanf(ifp, STRIPE_MAGIC " %d %d", &count, &size) == 2 && count > 1 &&
+       count <= MAX_STRIPES && size > 0 && size <= NUM_BLOCKS)
+    {
+      *stripes = count;
+      *chunk = size;
+    }
+    fclose(ifp);
+  }
+  return 0;
+}
+
+// Map the files of the image called filename read-only into a new region the size of
+// data[]. Nothing is read until a command touches a page, and the pages are the host's
+// cached ones, shared with every process that maps the image. Returns the region, or
+// NULL after reporting why.
+uint8_t (*mapImage(char * filename, int stripes, int chunk))[BLOCK_SIZE]
+{
+  int fds[MAX_STRIPES];
+  off_t needed[MAX_STRIPES];
+  char path[80];
+  int i;
+
+  for(i = 0; i < stripes; i++)
+  {
+    stripeMemberPath(filename, stripes, i, path, sizeof(path));
+    fds[i] = open(path, O_RDONLY);
+    if(fds[i] == -1)
+    {
+      perror(path);
+      while(i--)
+      {
+        close(fds[i]);
+      }
+      return NULL;
+    }
+    needed[i] = 0;
+  }
+
+  int32_t first;
+  int member;
+  for(first = 0; first < NUM_BLOCKS; first += chunk)
+  {
+    off_t end = stripeLayoutOffset(first, stripes, chunk, &member) +
+                (off_t)(NUM_BLOCKS - first < chunk ? NUM_BLOCKS - first : chunk) * BLOCK_SIZE;
+    if(end > needed[member])
+    {
+      needed[member] = end;
+    }
+  }
+
+  // Chunks are mapped one at a time, so each has to start on a page in memory and in its
+  // member. Images made before createfs enforced this can still be opened privately.
+  int failed = 0;
+  long page_blocks = sysconf(_SC_PAGESIZE) / BLOCK_SIZE;
+  if(stripes > 1 && page_blocks > 1 && chunk % page_blocks)
+  {
+    printf("The chunk size of %d blocks is not a multiple of the page size.\n", chunk);
+    failed = 1;
+  }
+
+  // Pages past the end of a file can't be read, so only saved images can be shared
+  for(i = 0; i < stripes && !failed; i++)
+  {
+    struct stat buf;
+    if(fstat(fds[i], &buf) || buf.st_size < needed[i])
+    {
+      printf("The image has to be saved before it can be shared.\n");
+      failed = 1;
+    }
+  }
+
+  // Reserve the whole range first so each chunk can be placed at its block
+  uint8_t (*region)[BLOCK_SIZE] = NULL;
+  if(!failed)
+  {
+    region = mmap(NULL, NUM_BLOCKS * BLOCK_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                  -1, 0);
+    if(region == MAP_FAILED)
+    {
+      perror("Mapping the image returned");
+      region = NULL;
+      failed = 1;
+    }
+  }
+
+  for(first = 0; first < NUM_BLOCKS && !failed; first += chunk)
+  {
+    off_t offset = stripeLayoutOffset(first, stripes, chunk, &member);
+    size_t len = (size_t)(NUM_BLOCKS - first < chunk ? NUM_BLOCKS - first : chunk) *
+                 BLOCK_SIZE;
+    if(mmap(region[first], len, PROT_READ, MAP_SHARED | MAP_FIXED, fds[member],
+            offset) == MAP_FAILED)
+    {
+      perror("Mapping the image returned");
+      failed = 1;
+    }
+  }
+
+  // The mappings keep the files open
+  for(i = 0; i < stripes; i++)
+  {
+    close(fds[i]);
+  }
+
+  if(failed && region)
+  {
+    munmap(region, NUM_BLOCKS * BLOCK_SIZE);
+  }
+  return failed ? NULL : region;
+}
+
+// Open an image. A shared image is mapped read-only rather than read in, and can be
+// open in any number of processes next to the one that has it open for writing.
+void openfs(char * filename, int shared)
+{    
+  stopFlusher();
+
+  int stripes, chunk;
+  if(readStripeGeometry(filename, &stripes, &chunk))
+  {
+    printError("open: File not found\n");
+    return;
+  }
+
+  // A shared image is mapped before anything about the current image changes, so the
+  // current image stays open if it can't be
+  uint8_t (*mapped)[BLOCK_SIZE] = NULL;
+  if(shared && (mapped = mapImage(filename, stripes, chunk)) == NULL)
+  {
+    printError("ERROR: %s can not be shared.\n", filename);
+    return;
+  }
+
+  if(switchImageLock(filename, !shared, 0))
+  {
+    if(mapped)
+    {
+      munmap(mapped, NUM_BLOCKS * BLOCK_SIZE);
+    }
+    return;
+  }
+  unshareImage();
+
+  memset(image_name, 0, 64);
+  strncpy(image_name, filename, 63);
+  stripe_count = stripes;
+  stripe_chunk = chunk;
+
+  if(shared)
+  {
+    // The private copy isn't needed while the image is shared
+    clearImage();
+    data = mapped;
+    setImagePointers();
+    image_shared = 1;
+  }
+  else if(transferImage(0))
+  {
+    // The lock and data[] already belong to the new image, so nothing is left open
+    printError("open: File not found\n");
+    releaseImage();
+    return;
+  }
+  clearDirty();
+
+  image_open = 1;
+  invalidateIndexes();
+
+  // Images from before checksums left the superblock's block empty. Anything else
+  // without the magic is not an image, and must not be saved over in this format.
+  static const uint8_t empty_block[BLOCK_SIZE];
+  int legacy = superblock->magic != FS_MAGIC;
+  if(legacy && memcmp(data[SUPERBLOCK], empty_block, BLOCK_SIZE))
+  {
+    printError("ERROR: %s is not a filesystem image.\n", filename);
+    releaseImage();
+    return;
+  }
+
+  // A shared image is checked by its writer, not by every reader that opens it
+  if(shared)
+  {
+    return;
+  }
+
+  // Verify the image on every open. Images from before checksums get them computed.
+  if(legacy)
+  {
+    rebuildChecksums();
+    return;
+  }
+
+  if(superblock->metadata_crc != metadataChecksum())
+  {
+    printf("WARNING: Metadata checksum mismatch, the image may be corrupt.\n");
+  }
+
+  scrub(1);
+}
+
+// Copy a host file without passing the data through this process: as a reflink that
+// shares the source's extents where the filesystem supports FICLONE, otherwise with
+// copy_file_range. Returns 1 for a reflink, 0 for a copy and -1 on failure.
+int copyHostFile(char * source, char * dest)
+{
+    int in = open(source, O_RDONLY);
+    if(in == -1)
+    {
+        perror(source);
+        return -1;
+    }
+
+    // Truncating the destination must not destroy the source
+    struct stat from, to;
+    if(fstat(in, &from) == -1 || (stat(dest, &to) == 0 && from.st_dev == to.st_dev &&
+                                  from.st_ino == to.st_ino))
+    {
+        printf("%s and %s are the same file\n", source, dest);
+        close(in);
+        return -1;
+    }
+
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out == -1)
+    {
+        perror(dest);
+        close(in);
+        return -1;
+    }
+
+    int result = -1;
+    if(ioctl(out, FICLONE, in) == 0)
+    {
+        result = 1;
+    }
+
+    if(result == -1)
+    {
+        off_t left = from.st_size;
+        ssize_t copied = 0;
+        while(left > 0 && (copied = copy_file_range(in, NULL, out, NULL, left, 0)) > 0)
+        {
+            left -= copied;
+        }
+        if(left == 0)
+        {
+            result = 0;
+        }
+        else
+        {
+            perror("Copying the image returned");
+        }
+    }
+
+    close(in);
+    close(out);
+    return result;
+}
+
+// Copy the image called source, with its members if it is striped over stripes files.
+// Returns 1 if every file was reflinked, 0 if some were copied and -1 on failure.
+int copyImage(char * source, char * dest, int stripes)
+{
+    int result = 1;
+    int copied;
+    char from[80], to[80];
+    int i;
+
+    if(stripes > 1)
+    {
+        result = copyHostFile(source, dest);
+    }
+    for(i = 0; i < stripes && result != -1; i++)
+    {
+        stripeMemberPath(source, stripes, i, from, sizeof(from));
+        stripeMemberPath(dest, stripes, i, to, sizeof(to));
+        copied = copyHostFile(from, to);
+        if(copied < result)
+        {
+            result = copied;
+        }
+    }
+    return result;
+}
+
+// Save the image and copy it to dest, which rollback can restore it from later
+void checkpoint(char * dest)
+{
+    if(savefs())
+    {
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int result = copyImage(image_name, dest, stripe_count);
+    if(result == -1)
+    {
+        printError("ERROR: Could not write the checkpoint %s\n", dest);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("checkpoint: %s %s in %.2f ms\n", dest, result ? "reflinked" : "copied",
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+// Replace the open image's files with a checkpoint and open the image again. Changes
+// since the checkpoint, saved or not, are lost.
+void rollback(char * source)
+{
+    int stripes, chunk;
+    if(readStripeGeometry(source, &stripes, &chunk))
+    {
+        printError("ERROR: Checkpoint %s not found.\n", source);
+        return;
+    }
+
+    // The flusher must not write to the files while they are being replaced
+    stopFlusher();
+
+    char name[64];
+    memcpy(name, image_name, 64);
+    if(lockImageData(F_WRLCK))
+    {
+        printError("ERROR: Could not lock the image.\n");
+        return;
+    }
+    int result = copyImage(source, name, stripes);
+    lockImageData(F_UNLCK);
+    if(result == -1)
+    {
+        printError("ERROR: Rolling back to %s failed, savefs will rewrite the image.\n",
+                   source);
+        return;
+    }
+
+    openfs(name, 0);
+}
+
+void closefs()
+{
+  if (image_open == 0)
+  {
+    printError("ERROR: Disk image is not open\n");
+    return;
+  }
+
+  stopFlusher();
+  releaseImage();
+}
+
+void list(char * attrib)
+{
+    int i;
+    int not_found = 1;
+    
+    for(i = 0; i < NUM_FILES; i++)
+    {
+
+        if(directory[i].in_use)
+        {
+            not_found=0;
+            char filename[65];
+            memset(filename, 0, 65);
+            strncpy(filename, directory[i].filename, strlen(directory[i].filename));
+
+            // Only format the stored time, listing must not change the inode
+            char added[16];
+            time_t mtime = inodes[directory[i].inode].mtime;
+            strftime(added, sizeof(added), "%H:%M:%S", localtime(&mtime));
+
+            if(!strcmp(attrib, "-h"))
+            {
+                printf("%s   %d   %s\n",filename,inodes[directory[i].inode].file_size, added);
+            }
+            else if(!strcmp(attrib, "-a"))
+            {
+                printf("%s   %d   %s   ",filename,inodes[directory[i].inode].file_size, added);
+                for (int j = 7; j >= 0; j--) 
+                {
+                    printf("%d", (inodes[directory[i].inode].attribute >> j) & 1);
+                }
+                printf("\n");
+            }
+            else
+            {
+                if(inodes[directory[i].inode].attribute != 1)
+                {
+                    printf("%s   %d   %s\n",filename,inodes[directory[i].inode].file_size,
+                    added);
+                }
+            }
+        }
+    }
+    if(not_found)
+    {
+        printError("ERROR: No file found\n");
+    }
+}
+
+int compareNames(const void * a, const void * b)
+{
+    return strcmp(directory[*(const int *) a].filename, directory[*(const int *) b].filename);
+}
+
+int compareSizes(const void * a, const void * b)
+{
+    uint32_t x = inodes[directory[*(const int *) a].inode].file_size;
+    uint32_t y = inodes[directory[*(const int *) b].inode].file_size;
+    return (x > y) - (x < y);
+}
+
+int compareTimes(const void * a, const void * b)
+{
+    int64_t x = inodes[directory[*(const int *) a].inode].mtime;
+    int64_t y = inodes[directory[*(const int *) b].inode].mtime;
+    return (x > y) - (x < y);
+}
+
+void buildIndexes()
+{
+    int i;
+    index_count = 0;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(directory[i].in_use)
+        {
+            name_index[index_count] = i;
+            size_index[index_count] = i;
+            mtime_index[index_count] = i;
+            index_count++;
+        }
+    }
+
+    qsort(name_index, index_count, sizeof(int), compareNames);
+    qsort(size_index, index_count, sizeof(int), compareSizes);
+    qsort(mtime_index, index_count, sizeof(int), compareTimes);
+    indexes_valid = 1;
+}
+
+// Predicates for lowerBound: true while the slot sorts before the wanted range
+int nameBefore(int slot, const void * key)
+{
+    return strcmp(directory[slot].filename, (const char *) key) < 0;
+}
+
+int sizeBelow(int slot, const void * key)
+{
+    return inodes[directory[slot].inode].file_size < *(const uint32_t *) key;
+}
+
+int sizeAtMost(int slot, const void * key)
+{
+    return inodes[directory[slot].inode].file_size <= *(const uint32_t *) key;
+}
+
+int timeAtMost(int slot, const void * key)
+{
+    return inodes[directory[slot].inode].mtime <= *(const int64_t *) key;
+}
+
+// Binary search a sorted index for the first position where before() is false
+int lowerBound(int * index, int (*before)(int, const void *), const void * key)
+{
+    int low = 0;
+    int high = index_count;
+    while(low < high)
+    {
+        int mid = (low + high) / 2;
+        if(before(index[mid], key))
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+struct findQuery
+{
+  char * name_prefix;
+  int has_min_size, has_max_size, has_newer;
+  uint32_t min_size, max_size;
+  int64_t newer;
+  uint8_t attr_set, attr_clear;     // attribute bits that must be set / clear
+};
+
+int matchesQuery(int slot, struct findQuery * query)
+{
+    struct inode * node = &inodes[directory[slot].inode];
+
+    if(query->name_prefix &&
+       strncmp(directory[slot].filename, query->name_prefix, strlen(query->name_prefix)))
+    {
+        return 0;
+    }
+    if(query->has_min_size && node->file_size < query->min_size)
+    {
+        return 0;
+    }
+    if(query->has_max_size && node->file_size > query->max_size)
+    {
+        return 0;
+    }
+    if(query->has_newer && node->mtime <= query->newer)
+    {
+        return 0;
+    }
+    return (node->attribute & query->attr_set) == query->attr_set &&
+           !(node->attribute & query->attr_clear);
+}
+
+// Print the files matching every condition in the query. The range each index allows
+// is narrowed by binary search and only the smallest range is walked, checking the
+// remaining conditions on each file in it.
+void find(struct findQuery * query)
+{
+    if(!indexes_valid)
+    {
+        buildIndexes();
+    }
+
+    int * index = name_index;
+    int first = 0;
+    int last = index_count;
+
+    if(query->name_prefix)
+    {
+        first = lowerBound(name_index, nameBefore, query->name_prefix);
+        last = first;
+        while(last < index_count && !strncmp(directory[name_index[last]].filename,
+              query->name_prefix, strlen(query->name_prefix)))
+        {
+            last++;
+        }
+    }
+
+    if(query->has_min_size || query->has_max_size)
+    {
+        int size_first = query->has_min_size ? lowerBound(size_index, sizeBelow,
+                         &query->min_size) : 0;
+        int size_last = query->has_max_size ? lowerBound(size_index, sizeAtMost,
+                        &query->max_size) : index_count;
+        if(size_last - size_first < last - first)
+        {
+            index = size_index;
+            first = size_first;
+            last = size_last;
+        }
+    }
+
+    if(query->has_newer)
+    {
+        int time_first = lowerBound(mtime_index, timeAtMost, &query->newer);
+        if(index_count - time_first < last - first)
+        {
+            index = mtime_index;
+            first = time_first;
+            last = index_count;
+        }
+    }
+
+    // Results are formatted into one buffer and written in large pieces
+    static char buffer[64 * 1024];
+    int used = 0;
+    int matches = 0;
+    int k;
+    for(k = first; k < last; k++)
+    {
+        int slot = index[k];
+        if(!matchesQuery(slot, query))
+        {
+            continue;
+        }
+
+        char modified[32];
+        time_t mtime = inodes[directory[slot].inode].mtime;
+        strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+
+        if(used > (int) sizeof(buffer) - 128)
+        {
+            fwrite(buffer, 1, used, stdout);
+            used = 0;
+        }
+        used += snprintf(&buffer[used], sizeof(buffer) - used, "%s   %u   %s\n",
+                         directory[slot].filename, inodes[directory[slot].inode].file_size,
+                         modified);
+        matches++;
+    }
+    fwrite(buffer, 1, used, stdout);
+
+    if(!matches)
+    {
+        printf("find: No files found\n");
+    }
+}
+
+// Content search. Patterns are at most a command line long, so shorter than a block,
+// and a match can span at most two blocks of a file.
+#define MAX_PATTERN_SIZE MAX_COMMAND_SIZE
+
+uint8_t search_pattern[MAX_PATTERN_SIZE];
+int search_length;
+int search_slots[NUM_FILES];
+int search_num_files;
+int search_next;
+uint32_t * search_hits[NUM_FILES];
+int search_hit_count[NUM_FILES];
+
+// Offset of the first match in buf that starts at or after start, or -1
+long findPattern(const uint8_t * buf, long len, long start)
+{
+    const uint8_t * pattern = search_pattern;
+    long m = search_length;
+    long i = start;
+
+#if defined(__x86_64__)
+    // Compare the first and last byte of the pattern at 16 positions at once and only
+    // check the whole pattern where both agree
+    __m128i first = _mm_set1_epi8(pattern[0]);
+    __m128i last = _mm_set1_epi8(pattern[m - 1]);
+    for(; i + m - 1 + 16 <= len; i += 16)
+    {
+        __m128i head = _mm_loadu_si128((const __m128i *) &buf[i]);
+        __m128i tail = _mm_loadu_si128((const __m128i *) &buf[i + m - 1]);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                                        _mm_cmpeq_epi8(tail, last)));
+        while(mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if(!memcmp(&buf[i + bit], pattern, m))
+            {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // The rest, or everything without SSE2, jumps between copies of the first byte
+    while(i + m <= len)
+    {
+        const uint8_t * found = memchr(&buf[i], pattern[0], len - m + 1 - i);
+        if(found == NULL)
+        {
+            break;
+        }
+        i = found - buf;
+        if(!memcmp(found, pattern, m))
+        {
+            return i;
+        }
+        i++;
+    }
+    return -1;
+}
+
+void addSearchHit(int k, uint32_t offset)
+{
+    int count = search_hit_count[k];
+    // Grow by doubling once the count reaches a power of two
+    if(count >= 16 && !(count & (count - 1)))
+    {
+        search_hits[k] = realloc(search_hits[k], 2 * count * sizeof(uint32_t));
+    }
+    else if(count == 0)
+    {
+        search_hits[k] = malloc(16 * sizeof(uint32_t));
+    }
+    search_hits[k][count] = offset;
+    search_hit_count[k] = count + 1;
+}
+
+// Scan one file's blocks in place, plus the seams between neighbouring blocks
+void searchFile(int k)
+{
+    struct inode * file = &inodes[directory[search_slots[k]].inode];
+    int num_blocks = (file->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int overlap = search_length - 1;
+    uint8_t seam[2 * MAX_PATTERN_SIZE];
+    int j;
+
+    for(j = 0; j < num_blocks; j++)
+    {
+        const uint8_t * block = data[file->blocks[j]];
+        uint32_t base = j * BLOCK_SIZE;
+        long len = j == num_blocks - 1 ? file->file_size - base : BLOCK_SIZE;
+        long at;
+
+        for(at = findPattern(block, len, 0); at != -1; at = findPattern(block, len, at + 1))
+        {
+            addSearchHit(k, base + at);
+        }
+
+        // Matches that start in the last overlap bytes of this block and end in the
+        // next one. Every block but the last is full.
+        if(j + 1 < num_blocks && overlap > 0)
+        {
+            long next_len = file->file_size - base - BLOCK_SIZE;
+            if(next_len > overlap)
+            {
+                next_len = overlap;
+            }
+            memcpy(seam, &block[BLOCK_SIZE - overlap], overlap);
+            memcpy(&seam[overlap], data[file->blocks[j + 1]], next_len);
+            for(at = findPattern(seam, overlap + next_len, 0); at != -1 && at < overlap;
+                at = findPattern(seam, overlap + next_len, at + 1))
+            {
+                addSearchHit(k, base + BLOCK_SIZE - overlap + at);
+            }
+        }
+    }
+}
+
+// Files are handed out one at a time so a large file does not hold up a whole share
+void * searchWorker(void * arg)
+{
+    int k;
+    while((k = __atomic_fetch_add(&search_next, 1, __ATOMIC_RELAXED)) < search_num_files)
+    {
+        searchFile(k);
+    }
+    return NULL;
+}
+
+// Print the file and byte offset of every occurrence of pattern in the files whose
+// names match files_glob, or in every file if it is NULL
+void search(uint8_t * pattern, int length, char * files_glob)
+{
+    memcpy(search_pattern, pattern, length);
+    search_length = length;
+    search_num_files = 0;
+    search_next = 0;
+
+    int i;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(directory[i].in_use &&
+           (files_glob == NULL || !fnmatch(files_glob, directory[i].filename, 0)))
+        {
+            search_hit_count[search_num_files] = 0;
+            search_slots[search_num_files++] = i;
+        }
+    }
+
+    int num_threads = workerCount(search_num_files, 1);
+    int args[MAX_WORKER_THREADS];
+    runWorkers(searchWorker, args, sizeof(int), num_threads);
+
+    int hits = 0;
+    int files = 0;
+    int k;
+    for(k = 0; k < search_num_files; k++)
+    {
+        for(i = 0; i < search_hit_count[k]; i++)
+        {
+            printf("%s   %u\n", directory[search_slots[k]].filename, search_hits[k][i]);
+        }
+        if(search_hit_count[k])
+        {
+            hits += search_hit_count[k];
+            files++;
+            free(search_hits[k]);
+        }
+    }
+
+    printf("search: %d match(es) in %d of %d file(s)\n", hits, files, search_num_files);
+}
+
+// Turn a string of hex digit pairs into bytes. Returns the number of bytes, or -1.
+int parseHex(char * hex, uint8_t * bytes, int max_bytes)
+{
+    int length = strlen(hex);
+    if(length == 0 || length % 2 || length / 2 > max_bytes)
+    {
+        return -1;
+    }
+
+    int i;
+    for(i = 0; i < length / 2; i++)
+    {
+        unsigned int byte;
+        if(!isxdigit((unsigned char) hex[2 * i]) || !isxdigit((unsigned char) hex[2 * i + 1]) ||
+           sscanf(&hex[2 * i], "%2x", &byte) != 1)
+        {
+            return -1;
+        }
+        bytes[i] = byte;
+    }
+    return length / 2;
+}
+
+void insert (char* filename, char* name)
 {
     // verify the filename isnt null
     if (filename == NULL)
     {
-        printf("ERROR: filename is NULL\n");
-        return;
+        printError("ERROR: filename is NULL\n");
+        return;
+    }
+
+    // "-" streams the file from stdin, which has no name of its own
+    int from_stdin = !strcmp(filename, "-");
+    if(name == NULL)
+    {
+        if(from_stdin)
+        {
+            printError("ERROR: A name is required when inserting from stdin.\n");
+            return;
+        }
+        name = filename;
+    }
+
+    if(strlen(name) >= 64)
+    {
+        printError("insert error: File name too long.\n");
+        return;
+    }
+
+    if(findDirectoryEntry(name) != -1)
+    {
+        printError("ERROR: %s already exists.\n", name);
+        return;
+    }
+
+    // Regular files have a known size, so they can be rejected before anything is
+    // allocated. Pipes and stdin are checked as the data arrives.
+    struct stat buf;
+    if(!from_stdin)
+    {
+        if(stat(filename, &buf) == -1)
+        {
+            printError("ERROR: File does not exist.\n");
+            return;
+        }
+
+        if(S_ISREG(buf.st_mode))
+        {
+            // verify the file isn't too big
+            if(buf.st_size > MAX_FILE_SIZE)
+            {
+                printError("ERROR: File is too large.\n");
+                return;
+            }
+
+            // verify there is enough space
+            if(buf.st_size > df())
+            {
+                printError("ERROR: Not enough free disk space.\n");
+                return;
+            }
+        }
+    }
+
+    // find an empty directory entry
+    int i;
+    int directory_entry = findFreeDirectoryEntry();
+    if(directory_entry == -1)
+    {
+        printError("ERROR: Could not find a free directory entry\n");
+        return;
+    }
+
+    // Open the input file read-only 
+    FILE *ifp = from_stdin ? stdin : fopen ( filename, "r" ); 
+    if(ifp == NULL)
+    {
+        perror("Opening input file returned");
+        command_status = 1;
+        return;
+    }
+
+    if(!from_stdin && S_ISREG(buf.st_mode))
+    {
+        printf("Reading %d bytes from %s\n", (int) buf.st_size, filename );
+    }
+
+    // We read the input sequentially in BLOCK_SIZE chunks, straight into newly
+    // allocated blocks, until it runs out. Nothing needs to know the length up front,
+    // so pipes work the same as regular files.
+    int32_t offset   = 0;               
+
+    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
+    // memory pool. Why? We are simulating the way the file system stores file data in
+    // blocks of space on the disk. block_index will keep us pointing to the area of
+    // the area that we will read from or write to.
+    int32_t block_index = -1;
+
+    // find a free inode
+    int32_t inode_index = findFreeInode();
+    if(inode_index == -1)
+    {
+      printError("ERROR: Can not find a free inode.\n");
+      if(!from_stdin)
+      {
+        fclose(ifp);
+      }
+      return;
+    }
+
+    free_inodes[inode_index] = 0;
+
+    // place the file infor in the directory
+    inodes[inode_index].file_size = 0;
+    inodes[inode_index].attribute = 0;
+    setInodeTime(inode_index);
+
+    int failed = 0;
+    while(1)
+    {
+        // A full file may only be followed by the end of the input
+        if(offset == MAX_FILE_SIZE)
+        {
+            int c = fgetc(ifp);
+            if(c != EOF)
+            {
+                printError("ERROR: File is too large.\n");
+                failed = 1;
+            }
+            break;
+        }
+
+        // find a free block
+        block_index = findFreeBlock();
+
+        if(block_index == -1)
+        {
+            printError("ERROR: Not enough free disk space.\n");
+            failed = 1;
+            break;
+        }   
+
+        // Read BLOCK_SIZE number of bytes from the input file and store them in our
+        // data array. fread only comes up short at the end of the input or on an error.
+        size_t bytes = fread( data[block_index], 1, BLOCK_SIZE, ifp );
+
+        if(bytes == 0)
+        {
+            free_blocks[block_index] = 1;
+        }
+        else
+        {
+            memset(&data[block_index][bytes], 0, BLOCK_SIZE - bytes);
+            updateChecksum(block_index);
+
+            // save the block in the inode
+            inodes[inode_index].blocks[offset / BLOCK_SIZE] = block_index;
+            offset += bytes;
+            inodes[inode_index].file_size = offset;
+        }
+
+        if(bytes < BLOCK_SIZE)
+        {
+            if(ferror(ifp))
+            {
+                printError("ERROR: An error occured reading from the input file.\n");
+                failed = 1;
+            }
+            break;
+        }
+    }
+
+    // We are done copying from the input file so close it out. stdin stays open and
+    // gets its EOF flag cleared so a terminal can keep typing commands.
+    if(from_stdin)
+    {
+        clearerr(stdin);
+    }
+    else
+    {
+        fclose( ifp );
+    }
+
+    if(failed)
+    {
+        // Give back everything this insert took
+        int num_blocks = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for(i = 0; i < num_blocks; i++)
+        {
+            releaseBlock(inodes[inode_index].blocks[i]);
+        }
+        inodes[inode_index].file_size = 0;
+        free_inodes[inode_index] = 1;
+        return;
+    }
+
+    directory[directory_entry].in_use = 1;
+    directory[directory_entry].inode = inode_index;
+    memset(directory[directory_entry].filename, 0, 64);
+    strncpy(directory[directory_entry].filename, name, 63);
+    invalidateIndexes();
+
+    if(from_stdin || !S_ISREG(buf.st_mode))
+    {
+        printf("Read %d bytes from %s\n", offset, from_stdin ? "stdin" : filename);
+    }
+}
+
+void Delete(char * filename)   
+// We have the name of the file, this function only works if we have a filesystem open
+{
+    int i = findDirectoryEntry(filename);
+    if(i == -1)
+    {
+        return;
+    }
+
+    int32_t location = (directory[i].inode);
+    directory[i]. in_use = 0;
+    invalidateIndexes();
+
+    inodes[location].in_use = 0;
+
+    // Blocks shared with clones or snapshots stay allocated for their other owners
+    int num_blocks = (inodes[location].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(i = 0; i < num_blocks; i++)
+    {
+        releaseBlock(inodes[location].blocks[i]);
+    }
+}
+
+
+void Undelete (char * filename)
+{
+  // A live file with the name owns its blocks already, and two live files can't share
+  // a name
+  if(findDirectoryEntry(filename) != -1)
+  {
+    printError("undelete: %s is not deleted.\n", filename);
+    return;
+  }
+
+  int i = 0;
+  while(i < NUM_FILES && (directory[i].in_use || directory[i].filename[0] == '\0' ||
+                          strcmp(directory[i].filename, filename)))
+  {
+    i++;
+  }
+
+  if(i == NUM_FILES)
+  {
+    printError("undelete: Can not find the file.\n"); 
+  }
+  else
+  {
+    int32_t location = (directory[i].inode);
+
+    // The file's old contents are only still there if nothing took its inode or any of
+    // its blocks since the delete
+    int num_blocks = (inodes[location].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int reused = inodes[location].in_use;
+    for(int j = 0; j < num_blocks && !reused; j++)
+    {
+      reused = !free_blocks[inodes[location].blocks[j]];
+    }
+
+    if(reused)
+    {
+      printError("undelete: The space used by %s has been reused.\n", filename);
+      return;
+    }
+
+    directory[i].in_use = 1;
+    invalidateIndexes();
+
+    inodes[location].in_use = 1;
+
+    for(int j = 0; j < num_blocks; j++)
+    {
+      free_blocks[inodes[location].blocks[j]] = 0;
+    }
+  }
+}
+  
+void attrib(char * attribute, char * filename)
+{
+    uint8_t x;
+
+    for(int i = 0; i < NUM_FILES; i++)
+    {
+        if(directory[i].in_use && !strcmp(filename, directory[i].filename))
+        {
+            if(attribute[0] == '+')
+            {
+                if(attribute[1] == 'r')
+                {
+                    x = 2;
+                }
+                else if(attribute[1] == 'h')
+                {
+                    x = 1;
+                }
+                inodes[directory[i].inode].attribute = x;
+            }
+            else if(!strcmp(attribute, "-h") || !strcmp(attribute, "-r"))
+            {
+                inodes[directory[i].inode].attribute = 0;
+            }
+        }
+    }
+}
+
+void readFile(char * filename, int start_byte, int num_bytes)
+{
+    for(int i = 0; i < NUM_FILES; i++)
+    {
+        if(!strcmp(filename, directory[i].filename))
+        {
+            // Only blocks inside the file exist to be checked or printed
+            if(start_byte < 0 || num_bytes < 0 ||
+               (int64_t) start_byte + num_bytes > inodes[directory[i].inode].file_size)
+            {
+                printError("ERROR: Bytes %d to %lld are outside of %s\n", start_byte,
+                           (long long) start_byte + num_bytes, filename);
+                return;
+            }
+
+            int end_byte = start_byte + num_bytes;
+            int start_block = start_byte / BLOCK_SIZE;
+            int end_block = end_byte / BLOCK_SIZE;
+
+            // Refuse to print anything from a block that fails its checksum
+            int last_block = end_byte % BLOCK_SIZE ? end_block : end_block - 1;
+            for(int j = start_block; j <= last_block; j++)
+            {
+                if(verifyBlock(inodes[directory[i].inode].blocks[j]))
+                {
+                    printError("ERROR: Checksum mismatch in block %d of %s\n", j, filename);
+                    return;
+                }
+            }
+
+            for(int j = start_block; j <= end_block; j++)
+            {
+                if(start_block == end_block)
+                {
+                    for(int k = start_byte % BLOCK_SIZE; k < end_byte % BLOCK_SIZE; k++)
+                    {
+                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
+                    }
+                }
+                else if(j == end_block)
+                {
+                    for(int k = 0; k < end_byte % BLOCK_SIZE; k++)
+                    {
+                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
+                    }
+
+                }
+                else if(j == start_block)
+                {
+                    for(int k = start_byte % BLOCK_SIZE; k < BLOCK_SIZE; k++)
+                    {
+                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
+                    }
+                }
+                else
+                {
+                    for(int k = 0; k < BLOCK_SIZE; k++)
+                    {
+                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
+                    }
+                }
+                
+            }
+        }
+    }
+}
+
+void encryptFile(char * filename, char cipher)
+{
+    for(int i = 0; i < NUM_FILES; i++)
+    {
+        if(!strcmp(filename, directory[i].filename))
+        {
+            int start_byte = 0;
+            int end_byte = inodes[directory[i].inode].file_size;
+            int start_block = 0;
+            int end_block = end_byte / BLOCK_SIZE;
+            int num_blocks = (end_byte + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+            // Encrypting rewrites every block, so blocks shared with a clone or a
+            // snapshot are copied first and the other owners keep the plain text
+            if(sharedBlocks(directory[i].inode, 0, num_blocks) * BLOCK_SIZE > df())
+            {
+                printError("ERROR: Not enough free disk space.\n");
+                return;
+            }
+            for(int j = 0; j < num_blocks; j++)
+            {
+                cowBlock(directory[i].inode, j);
+            }
+
+            for(int j = start_block; j <= end_block; j++)
+            {
+                if(start_block == end_block)
+                {
+                    for(int k = start_byte % BLOCK_SIZE; k < end_byte % BLOCK_SIZE; k++)
+                    {
+                        data[inodes[directory[i].inode].blocks[j]][k] = 
+                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
+                    }
+                }
+                else if(j == end_block)
+                {
+                    for(int k = 0; k < end_byte % BLOCK_SIZE; k++)
+                    {
+                        data[inodes[directory[i].inode].blocks[j]][k] = 
+                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
+                    }
+
+                }
+                else if(j == start_block)
+                {
+                    for(int k = start_byte % BLOCK_SIZE; k < BLOCK_SIZE; k++)
+                    {
+                        data[inodes[directory[i].inode].blocks[j]][k] = 
+                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
+                    }
+                }
+                else
+                {
+                    for(int k = 0; k < BLOCK_SIZE; k++)
+                    {
+                        data[inodes[directory[i].inode].blocks[j]][k] = 
+                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
+                    }
+                }
+                
+            }
+
+            for(int j = 0; j < num_blocks; j++)
+            {
+                updateChecksum(inodes[directory[i].inode].blocks[j]);
+            }
+        }
+    }
+}
+
+// Grow or shrink a file to new_size. Only the blocks past the old or new end of the
+// file are touched: growth allocates zeroed blocks, shrinking hands blocks back to
+// the free block map. Returns 0 on success and -1 if the file can not be resized.
+int resizeFile(int32_t inode, uint32_t new_size)
+{
+    uint32_t old_size = inodes[inode].file_size;
+    int old_blocks = (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int new_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int j;
+
+    if(new_size > MAX_FILE_SIZE)
+    {
+        printError("ERROR: File is too large.\n");
+        return -1;
+    }
+
+    // Growing rewrites the partial last block, which needs a copy if it is shared
+    int tail_copy = new_size > old_size && old_size % BLOCK_SIZE &&
+                    sharedBlocks(inode, old_blocks - 1, old_blocks);
+    if(new_blocks > old_blocks && (new_blocks - old_blocks + tail_copy) * BLOCK_SIZE > df())
+    {
+        printError("ERROR: Not enough free disk space.\n");
+        return -1;
+    }
+
+    // Bytes past the old end of file in its last block may hold stale data from an
+    // earlier truncate, so clear them before they become part of the file
+    if(new_size > old_size && old_size % BLOCK_SIZE)
+    {
+        int32_t last = cowBlock(inode, old_blocks - 1);
+        if(last == -1)
+        {
+            printError("ERROR: Not enough free disk space.\n");
+            return -1;
+        }
+        memset(&data[last][old_size % BLOCK_SIZE], 0, BLOCK_SIZE - old_size % BLOCK_SIZE);
+        updateChecksum(last);
+    }
+
+    for(j = old_blocks; j < new_blocks; j++)
+    {
+        int32_t block_index = findFreeBlock();
+        memset(data[block_index], 0, BLOCK_SIZE);
+        updateChecksum(block_index);
+        inodes[inode].blocks[j] = block_index;
+    }
+
+    for(j = new_blocks; j < old_blocks; j++)
+    {
+        releaseBlock(inodes[inode].blocks[j]);
+        inodes[inode].blocks[j] = 0;
+    }
+
+    inodes[inode].file_size = new_size;
+    return 0;
+}
+
+// Overwrite the stored file starting at offset with the contents of hostfile. The
+// file grows if the write runs past its end; blocks outside the range are untouched.
+void writeFile(char * filename, uint32_t offset, char * hostfile)
+{
+    int entry = findDirectoryEntry(filename);
+    if(entry == -1)
+    {
+        printError("ERROR: File not found.\n");
+        return;
+    }
+
+    int32_t inode = directory[entry].inode;
+
+    // read-only files can not be modified any more than they can be deleted
+    if(inodes[inode].attribute & 2)
+    {
+        printError("ERROR: Can't modify a read-only file\n");
+        return;
+    }
+
+    struct stat buf;
+    if(stat(hostfile, &buf) == -1)
+    {
+        printError("ERROR: File does not exist.\n");
+        return;
+    }
+
+    // The size is needed up front to grow the file before the data is read into it
+    if(!S_ISREG(buf.st_mode))
+    {
+        printError("ERROR: %s is not a regular file.\n", hostfile);
+        return;
+    }
+
+    if(offset + buf.st_size > MAX_FILE_SIZE)
+    {
+        printError("ERROR: File is too large.\n");
+        return;
+    }
+
+    FILE *ifp = fopen(hostfile, "r");
+    if(ifp == NULL)
+    {
+        perror("Opening input file returned");
+        command_status = 1;
+        return;
+    }
+
+    uint32_t end = offset + buf.st_size;
+    uint32_t old_size = inodes[inode].file_size;
+
+    // Shared blocks inside the range get copied, on top of any blocks added by growth
+    int old_blocks = (inodes[inode].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int last_block = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int new_blocks = last_block > old_blocks ? last_block - old_blocks : 0;
+    if(last_block > old_blocks)
+    {
+        last_block = old_blocks;
+    }
+    int copies = offset / BLOCK_SIZE < last_block ?
+                 sharedBlocks(inode, offset / BLOCK_SIZE, last_block) : 0;
+    if((new_blocks + copies) * BLOCK_SIZE > df())
+    {
+        printError("ERROR: Not enough free disk space.\n");
+        fclose(ifp);
+        return;
+    }
+
+    if(end > inodes[inode].file_size && resizeFile(inode, end))
+    {
+        fclose(ifp);
+        return;
+    }
+
+    printf("Writing %d bytes from %s at offset %d\n", (int) buf.st_size, hostfile, offset);
+
+    // Read straight into the affected blocks, a partial block at each end at most
+    uint32_t position = offset;
+    while(position < end)
+    {
+        int32_t block_index = cowBlock(inode, position / BLOCK_SIZE);
+        if(block_index == -1)
+        {
+            printError("ERROR: Not enough free disk space.\n");
+            break;
+        }
+
+        uint32_t block_offset = position % BLOCK_SIZE;
+        uint32_t num_bytes = BLOCK_SIZE - block_offset;
+
+        if(num_bytes > end - position)
+        {
+            num_bytes = end - position;
+        }
+
+        size_t bytes = fread(&data[block_index][block_offset], 1, num_bytes, ifp);
+        updateChecksum(block_index);
+
+        if(bytes != num_bytes)
+        {
+            printError("ERROR: An error occured reading from the input file.\n");
+            position += bytes;
+            break;
+        }
+
+        position += num_bytes;
+    }
+
+    // If the input ran short, don't leave the file grown with zeros past what was read
+    if(position < end && end > old_size)
+    {
+        resizeFile(inode, position > old_size ? position : old_size);
+    }
+
+    if(position > offset || inodes[inode].file_size != old_size)
+    {
+        setInodeTime(inode);
+    }
+    fclose(ifp);
+}
+
+// Append the contents of hostfile to the end of the stored file
+void appendFile(char * filename, char * hostfile)
+{
+    int entry = findDirectoryEntry(filename);
+    if(entry == -1)
+    {
+        printError("ERROR: File not found.\n");
+        return;
+    }
+
+    writeFile(filename, inodes[directory[entry].inode].file_size, hostfile);
+}
+
+// Set the size of the stored file, freeing or allocating blocks as needed
+void truncateFile(char * filename, uint32_t size)
+{
+    int entry = findDirectoryEntry(filename);
+    if(entry == -1)
+    {
+        printError("ERROR: File not found.\n");
+        return;
+    }
+
+    int32_t inode = directory[entry].inode;
+
+    if(inodes[inode].attribute & 2)
+    {
+        printError("ERROR: Can't modify a read-only file\n");
+        return;
+    }
+
+    if(resizeFile(inode, size) == 0)
+    {
+        setInodeTime(inode);
+    }
+}
+
+// Bring a stored file up to date with a host file, rewriting only the blocks whose
+// contents differ. Returns the number of bytes written, or -1.
+long syncFile(int32_t inode, char * path, struct stat * host)
+{
+    if(inodes[inode].attribute & 2)
+    {
+        printError("ERROR: Can't modify a read-only file\n");
+        return -1;
+    }
+
+    if(host->st_size > MAX_FILE_SIZE)
+    {
+        printError("ERROR: %s is too large.\n", path);
+        return -1;
+    }
+
+    // Enough space for any growth and for copying every shared block that may change
+    int old_blocks = (inodes[inode].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int new_blocks = (host->st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int kept = old_blocks < new_blocks ? old_blocks : new_blocks;
+    int growth = new_blocks > old_blocks ? new_blocks - old_blocks : 0;
+    if((growth + sharedBlocks(inode, 0, kept)) * BLOCK_SIZE > df())
+    {
+        printError("ERROR: Not enough free disk space.\n");
+        return -1;
+    }
+
+    FILE * ifp = fopen(path, "r");
+    if(ifp == NULL)
+    {
+        perror("Opening input file returned");
+        command_status = 1;
+        return -1;
+    }
+
+    if(resizeFile(inode, host->st_size))
+    {
+        fclose(ifp);
+        return -1;
+    }
+
+    // The image is in memory, so each host block is compared with the stored block
+    // directly and only the blocks that differ are copied, or replaced if shared
+    uint8_t buffer[BLOCK_SIZE];
+    long written = 0;
+    int j;
+    for(j = 0; j < new_blocks; j++)
+    {
+        size_t len = host->st_size - (off_t) j * BLOCK_SIZE;
+        if(len > BLOCK_SIZE)
+        {
+            len = BLOCK_SIZE;
+        }
+
+        // Leave the old mtime on a half updated file so the next sync rewrites it
+        if(fread(buffer, 1, len, ifp) != len)
+        {
+            printError("ERROR: An error occured reading from %s.\n", path);
+            fclose(ifp);
+            return -1;
+        }
+
+        if(memcmp(data[inodes[inode].blocks[j]], buffer, len))
+        {
+            int32_t block = cowBlock(inode, j);
+            memcpy(data[block], buffer, len);
+            updateChecksum(block);
+            written += len;
+        }
+        else if(j >= old_blocks)
+        {
+            // Blocks added by the growth were written with zeros even if they stay so
+            written += len;
+        }
+    }
+    fclose(ifp);
+
+    // The host's modification time lets the next sync skip the file if it is unchanged
+    inodes[inode].mtime = host->st_mtime;
+    invalidateIndexes();
+    return written;
+}
+
+// Make the stored files mirror the regular files in hostdir: new files are inserted,
+// files that are no longer there are deleted, and files whose size or modification
+// time differ are rewritten block by block where their contents changed
+void syncDirectory(char * hostdir)
+{
+    DIR * dir = opendir(hostdir);
+    if(dir == NULL)
+    {
+        printError("ERROR: Can not open directory %s\n", hostdir);
+        return;
+    }
+
+    uint8_t seen[NUM_FILES];
+    memset(seen, 0, NUM_FILES);
+    int added = 0, updated = 0, unchanged = 0, deleted = 0, failed = 0;
+    long written = 0;
+    struct dirent * dent;
+    char path[PATH_MAX];
+
+    while((dent = readdir(dir)) != NULL)
+    {
+        struct stat host;
+        snprintf(path, sizeof(path), "%s/%s", hostdir, dent->d_name);
+        if(stat(path, &host) == -1 || !S_ISREG(host.st_mode))
+        {
+            continue;
+        }
+
+        if(strlen(dent->d_name) >= 64)
+        {
+            printError("ERROR: Skipping %s, the name is too long.\n", dent->d_name);
+            failed++;
+            continue;
+        }
+
+        int entry = findDirectoryEntry(dent->d_name);
+        if(entry == -1)
+        {
+            insert(path, dent->d_name);
+            entry = findDirectoryEntry(dent->d_name);
+            if(entry != -1)
+            {
+                seen[entry] = 1;
+                inodes[directory[entry].inode].mtime = host.st_mtime;
+                written += host.st_size;
+                added++;
+            }
+            else
+            {
+                failed++;
+            }
+            continue;
+        }
+
+        seen[entry] = 1;
+        int32_t inode = directory[entry].inode;
+        if(inodes[inode].file_size == host.st_size && inodes[inode].mtime == host.st_mtime)
+        {
+            unchanged++;
+            continue;
+        }
+
+        long bytes = syncFile(inode, path, &host);
+        if(bytes != -1)
+        {
+            written += bytes;
+            updated++;
+        }
+        else
+        {
+            failed++;
+        }
+    }
+    closedir(dir);
+
+    int i;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(directory[i].in_use && !seen[i])
+        {
+            if(inodes[directory[i].inode].attribute & 2)
+            {
+                printError("ERROR: Can't delete the read-only file %s\n", directory[i].filename);
+                failed++;
+                continue;
+            }
+            Delete(directory[i].filename);
+            deleted++;
+        }
+    }
+
+    printf("sync: %d added, %d updated, %d unchanged, %d deleted, %d failed, "
+           "%ld bytes written\n", added, updated, unchanged, deleted, failed, written);
+    if(failed)
+    {
+        command_status = 1;
+    }
+}
+
+// Create dst as a copy of src that shares all of its data blocks. Only the inode is
+// copied; the blocks are duplicated later, one at a time, when either file writes them.
+void cloneFile(char * src, char * dst)
+{
+    int entry = findDirectoryEntry(src);
+    if(entry == -1)
+    {
+        printError("ERROR: File not found.\n");
+        return;
+    }
+
+    if(strlen(dst) >= 64)
+    {
+        printError("ERROR: File name too long.\n");
+        return;
+    }
+
+    if(findDirectoryEntry(dst) != -1)
+    {
+        printError("ERROR: %s already exists.\n", dst);
+        return;
+    }
+
+    int i;
+    int directory_entry = findFreeDirectoryEntry();
+    if(directory_entry == -1)
+    {
+        printError("ERROR: Could not find a free directory entry\n");
+        return;
+    }
+
+    int32_t inode_index = findFreeInode();
+    if(inode_index == -1)
+    {
+        printError("ERROR: Can not find a free inode.\n");
+        return;
+    }
+
+    int32_t source = directory[entry].inode;
+    memcpy(&inodes[inode_index], &inodes[source], sizeof(struct inode));
+    setInodeTime(inode_index);
+
+    int num_blocks = (inodes[source].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(i = 0; i < num_blocks; i++)
+    {
+        block_shares[inodes[source].blocks[i]]++;
+    }
+
+    directory[directory_entry].in_use = 1;
+    directory[directory_entry].inode = inode_index;
+    memset(directory[directory_entry].filename, 0, 64);
+    strncpy(directory[directory_entry].filename, dst, 63);
+    invalidateIndexes();
+}
+
+// Snapshot copies skip the superblock, so copy k lives in metadata block snapshotMetaBlock(k)
+int snapshotMetaBlock(int k)
+{
+    return k < SUPERBLOCK ? k : k + 1;
+}
+
+int findSnapshot(char * name)
+{
+    int i;
+    for(i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if(snapshots[i].in_use && !strcmp(snapshots[i].name, name))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Call fn on every block of every file listed in the given directory and inode tables
+void forEachFileBlock(struct directoryEntry * dir, struct inode * table, void (*fn)(int32_t))
+{
+    int i, j;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(dir[i].in_use)
+        {
+            struct inode * node = &table[dir[i].inode];
+            int num_blocks = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for(j = 0; j < num_blocks; j++)
+            {
+                fn(node->blocks[j]);
+            }
+        }
+    }
+}
+
+// Reassemble a snapshot's metadata in the same layout as data[], so its directory and
+// inode table can be read in place. The caller frees the buffer.
+uint8_t * loadSnapshot(int s)
+{
+    uint8_t * copy = (uint8_t *) calloc(FREE_BLOCK_MAP, BLOCK_SIZE);
+    if(copy == NULL)
+    {
+        return NULL;
+    }
+
+    int k;
+    for(k = 0; k < SNAPSHOT_META_BLOCKS; k++)
+    {
+        memcpy(&copy[snapshotMetaBlock(k) * BLOCK_SIZE], data[snapshots[s].blocks[k]], BLOCK_SIZE);
+    }
+    return copy;
+}
+
+// Freeze the current directory and inode tables under name. The tables are copied;
+// file data is not, the snapshot just takes a share of every block in use.
+void snapshotCreate(char * name)
+{
+    if(strlen(name) >= 64)
+    {
+        printError("ERROR: Snapshot name too long.\n");
+        return;
+    }
+
+    if(findSnapshot(name) != -1)
+    {
+        printError("ERROR: Snapshot %s already exists.\n", name);
+        return;
+    }
+
+    int s;
+    for(s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+        if(!snapshots[s].in_use)
+        {
+            break;
+        }
+    }
+
+    if(s == MAX_SNAPSHOTS)
+    {
+        printError("ERROR: No free snapshot slots.\n");
+        return;
+    }
+
+    if(SNAPSHOT_META_BLOCKS * BLOCK_SIZE > df())
+    {
+        printError("ERROR: Not enough free disk space.\n");
+        return;
+    }
+
+    int k;
+    for(k = 0; k < SNAPSHOT_META_BLOCKS; k++)
+    {
+        int32_t block = findFreeBlock();
+        memcpy(data[block], data[snapshotMetaBlock(k)], BLOCK_SIZE);
+        updateChecksum(block);
+        snapshots[s].blocks[k] = block;
+    }
+
+    forEachFileBlock(directory, inodes, retainBlock);
+
+    memset(snapshots[s].name, 0, 64);
+    strncpy(snapshots[s].name, name, 63);
+    snapshots[s].time = time(0);
+    snapshots[s].in_use = 1;
+}
+
+// Drop a snapshot, releasing its table copies and its share of the file blocks
+void snapshotDelete(char * name)
+{
+    int s = findSnapshot(name);
+    if(s == -1)
+    {
+        printError("ERROR: Snapshot not found.\n");
+        return;
+    }
+
+    uint8_t * copy = loadSnapshot(s);
+    if(copy == NULL)
+    {
+        printError("ERROR: Out of memory.\n");
+        return;
+    }
+
+    forEachFileBlock((struct directoryEntry *) copy,
+                     (struct inode *) &copy[FIRST_INODE_BLOCK * BLOCK_SIZE], releaseBlock);
+    free(copy);
+
+    int k;
+    for(k = 0; k < SNAPSHOT_META_BLOCKS; k++)
+    {
+        releaseBlock(snapshots[s].blocks[k]);
+    }
+    snapshots[s].in_use = 0;
+}
+
+// Replace the current directory and inode tables with the ones saved in a snapshot.
+// The snapshot is kept, so it can be restored again later.
+void snapshotRestore(char * name)
+{
+    int s = findSnapshot(name);
+    if(s == -1)
+    {
+        printError("ERROR: Snapshot not found.\n");
+        return;
+    }
+
+    forEachFileBlock(directory, inodes, releaseBlock);
+
+    int k;
+    for(k = 0; k < SNAPSHOT_META_BLOCKS; k++)
+    {
+        memcpy(data[snapshotMetaBlock(k)], data[snapshots[s].blocks[k]], BLOCK_SIZE);
+    }
+
+    forEachFileBlock(directory, inodes, retainBlock);
+    invalidateIndexes();
+}
+
+void snapshotList()
+{
+    int i;
+    int not_found = 1;
+    for(i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if(snapshots[i].in_use)
+        {
+            not_found = 0;
+            char taken[32];
+            time_t snapshot_time = snapshots[i].time;
+            strftime(taken, sizeof(taken), "%Y-%m-%d %H:%M:%S", localtime(&snapshot_time));
+            printf("%s   %s\n", snapshots[i].name, taken);
+        }
+    }
+    if(not_found)
+    {
+        printf("snapshot: No snapshots found\n");
+    }
+}
+
+// Directory and inode tables fsck counts block owners from: the live tables followed
+// by the tables of every snapshot
+struct directoryEntry * fsck_dirs[1 + MAX_SNAPSHOTS];
+struct inode * fsck_tables[1 + MAX_SNAPSHOTS];
+int fsck_num_tables;
+
+// Number of owners found for every block
+uint16_t fsck_refs[NUM_BLOCKS];
+
+// Work handed to one fsck thread: every step'th directory entry starting at first
+struct fsckRange
+{
+  int first;
+  int step;
+};
+
+void * fsckWorker(void * arg)
+{
+    struct fsckRange * range = (struct fsckRange *) arg;
+    int t, i, j;
+
+    for(t = 0; t < fsck_num_tables; t++)
+    {
+        for(i = range->first; i < NUM_FILES; i += range->step)
+        {
+            struct directoryEntry * entry = &fsck_dirs[t][i];
+            if(!entry->in_use || entry->inode < 0 || entry->inode >= NUM_FILES)
+            {
+                continue;
+            }
+
+            struct inode * node = &fsck_tables[t][entry->inode];
+            int num_blocks = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for(j = 0; j < num_blocks && j < BLOCKS_PER_FILE; j++)
+            {
+                int32_t block = node->blocks[j];
+                if(block >= FIRST_DATA_BLOCK && block < NUM_BLOCKS)
+                {
+                    __atomic_fetch_add(&fsck_refs[block], 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Check the directory, inode table, free inode map, free block map and block share
+// counts against each other. The expected maps are rebuilt from the directory, inode
+// and snapshot tables, with the block owners counted across several threads. With
+// repair set the maps are rewritten to match. Returns the number of problems found.
+int fsck(int repair)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int problems = 0;
+    int i, j;
+
+    // Inodes referenced by live files, used to find an unused one for repairs
+    uint8_t referenced[NUM_FILES];
+    memset(referenced, 0, NUM_FILES);
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(directory[i].in_use && directory[i].inode >= 0 && directory[i].inode < NUM_FILES)
+        {
+            referenced[directory[i].inode] = 1;
+        }
+    }
+
+    // Make sure every live file points at a valid inode of its own and valid blocks
+    uint8_t claimed[NUM_FILES];
+    memset(claimed, 0, NUM_FILES);
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(!directory[i].in_use)
+        {
+            continue;
+        }
+
+        int32_t inode = directory[i].inode;
+        if(inode < 0 || inode >= NUM_FILES)
+        {
+            printf("fsck: %s points at invalid inode %d\n", directory[i].filename, inode);
+            problems++;
+            if(repair)
+            {
+                directory[i].in_use = 0;
+            }
+            continue;
+        }
+
+        if(claimed[inode])
+        {
+            printf("fsck: %s shares inode %d with another file\n", directory[i].filename, inode);
+            problems++;
+            if(repair)
+            {
+                // Give the file its own copy of the inode; the blocks become shared
+                // and their share counts are fixed below
+                int32_t copy;
+                for(copy = 0; copy < NUM_FILES && referenced[copy]; copy++);
+                if(copy == NUM_FILES)
+                {
+                    directory[i].in_use = 0;
+                    continue;
+                }
+                memcpy(&inodes[copy], &inodes[inode], sizeof(struct inode));
+                directory[i].inode = copy;
+                referenced[copy] = 1;
+                claimed[copy] = 1;
+                inode = copy;
+            }
+        }
+        claimed[inode] = 1;
+
+        if(inodes[inode].file_size > MAX_FILE_SIZE)
+        {
+            printf("fsck: %s has invalid size %u\n", directory[i].filename,
+                   inodes[inode].file_size);
+            problems++;
+            if(repair)
+            {
+                inodes[inode].file_size = MAX_FILE_SIZE;
+            }
+        }
+
+        int num_blocks = (inodes[inode].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for(j = 0; j < num_blocks && j < BLOCKS_PER_FILE; j++)
+        {
+            int32_t block = inodes[inode].blocks[j];
+            if(block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS)
+            {
+                printf("fsck: %s has invalid block %d at index %d\n", directory[i].filename,
+                       block, j);
+                problems++;
+                if(repair)
+                {
+                    inodes[inode].file_size = j * BLOCK_SIZE;
+                }
+                break;
+            }
+        }
+    }
+
+    // Count the owners of every block: live files, snapshot files and snapshot tables
+    memset(fsck_refs, 0, sizeof(fsck_refs));
+    uint8_t * copies[MAX_SNAPSHOTS];
+    int num_copies = 0;
+
+    fsck_dirs[0] = directory;
+    fsck_tables[0] = inodes;
+    fsck_num_tables = 1;
+
+    for(i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if(!snapshots[i].in_use)
+        {
+            continue;
+        }
+
+        for(j = 0; j < SNAPSHOT_META_BLOCKS; j++)
+        {
+            int32_t block = snapshots[i].blocks[j];
+            if(block >= FIRST_DATA_BLOCK && block < NUM_BLOCKS)
+            {
+                fsck_refs[block]++;
+            }
+        }
+
+        uint8_t * copy = loadSnapshot(i);
+        if(copy == NULL)
+        {
+            printf("fsck: Out of memory loading snapshot %s\n", snapshots[i].name);
+            continue;
+        }
+        copies[num_copies++] = copy;
+        fsck_dirs[fsck_num_tables] = (struct directoryEntry *) copy;
+        fsck_tables[fsck_num_tables] = (struct inode *) &copy[FIRST_INODE_BLOCK * BLOCK_SIZE];
+        fsck_num_tables++;
     }
 
-    // verify the file exists
-    struct stat buf;
-    int ret = stat(filename, &buf);
+    int num_threads = workerCount(NUM_FILES * fsck_num_tables, 64);
+    struct fsckRange ranges[MAX_WORKER_THREADS];
+    for(i = 0; i < num_threads; i++)
+    {
+        ranges[i].first = i;
+        ranges[i].step = num_threads;
+    }
+    runWorkers(fsckWorker, ranges, sizeof(struct fsckRange), num_threads);
 
-    if(ret == -1)
+    for(i = 0; i < num_copies; i++)
     {
-        printf("ERROR: File does not exist.\n");
-        return;
+        free(copies[i]);
     }
 
-    // verify the file isn't too big
-    if(buf.st_size > MAX_FILE_SIZE)
+    // A block with n owners must be allocated with n - 1 shares; one with none is free
+    int leaked = 0, marked_free = 0, double_allocated = 0, over_shared = 0;
+    int32_t block;
+    for(block = FIRST_DATA_BLOCK; block < NUM_BLOCKS; block++)
     {
-        printf("ERROR: File is too large.\n");
-        return;
+        int refs = fsck_refs[block];
+        if(refs == 0)
+        {
+            if(!free_blocks[block] || block_shares[block])
+            {
+                leaked++;
+                if(repair)
+                {
+                    free_blocks[block] = 1;
+                    block_shares[block] = 0;
+                }
+            }
+            continue;
+        }
+
+        if(free_blocks[block])
+        {
+            marked_free++;
+        }
+        if(block_shares[block] < refs - 1)
+        {
+            double_allocated++;
+        }
+        else if(block_shares[block] > refs - 1)
+        {
+            over_shared++;
+        }
+
+        if(repair)
+        {
+            free_blocks[block] = 0;
+            block_shares[block] = refs - 1;
+        }
     }
 
-    // verify there is enough space
-    if(buf.st_size > df())
+    if(leaked)
     {
-        printf("ERROR: Not enough free disk space.\n");
-        return;
+        printf("fsck: %d leaked block(s)\n", leaked);
+    }
+    if(marked_free)
+    {
+        printf("fsck: %d block(s) in use but marked free\n", marked_free);
     }
+    if(double_allocated)
+    {
+        printf("fsck: %d block(s) owned by more files than their share count\n",
+               double_allocated);
+    }
+    if(over_shared)
+    {
+        printf("fsck: %d block(s) with a share count above their owners\n", over_shared);
+    }
+    problems += leaked + marked_free + double_allocated + over_shared;
 
-    // find an empty directory entry
-    int i;
-    int directory_entry = -1;
+    // Inodes stay allocated while a live file uses them, or while a deleted directory
+    // entry still names them so the file can be undeleted
+    uint8_t expected[NUM_FILES];
+    memcpy(expected, claimed, NUM_FILES);
     for(i = 0; i < NUM_FILES; i++)
     {
-        if(directory[i].in_use == 0)
+        int32_t inode = directory[i].inode;
+        if(!directory[i].in_use && directory[i].filename[0] && inode >= 0 && inode < NUM_FILES)
         {
-          directory_entry = i;
+            expected[inode] = 1;
+        }
+    }
 
-          break;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(!expected[i] && !free_inodes[i])
+        {
+            printf("fsck: inode %d is orphaned\n", i);
+            problems++;
+            if(repair)
+            {
+                free_inodes[i] = 1;
+            }
+        }
+        else if(expected[i] && free_inodes[i])
+        {
+            printf("fsck: inode %d is in use but marked free\n", i);
+            problems++;
+            if(repair)
+            {
+                free_inodes[i] = 0;
+            }
         }
     }
-    
-    if(directory_entry == -1)
+
+    if(repair && problems)
     {
-        printf("ERROR: Could not find a free directory entry\n");
-        return;
+        invalidateIndexes();
     }
 
-    // Open the input file read-only 
-    FILE *ifp = fopen ( filename, "r" ); 
-    printf("Reading %d bytes from %s\n", (int) buf.st_size, filename );
-    
-    // Save off the size of the input file since we'll use it in a couple of places and 
-    // also initialize our index variables to zero. 
-    int32_t copy_size   = buf.st_size;
-   // Bytes_File = copy_size + Bytes_File;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    printf("fsck: %d problem(s) %s in %.2f ms\n", problems,
+           repair && problems ? "repaired" : "found", ms);
+    return problems;
+}
 
-    time_t temp_time = time(0);
-    struct tm *temp_info = localtime(&temp_time);
+// Write all of buf to fd, riding out short writes and signals
+int writeAll(int fd, const uint8_t * buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
 
-    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-    int32_t offset   = 0;               
+#define RETRIEVE_BUFFER_SIZE (64 * BLOCK_SIZE)
 
-    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-    // memory pool. Why? We are simulating the way the file system stores file data in
-    // blocks of space on the disk. block_index will keep us pointing to the area of
-    // the area that we will read from or write to.
-    int32_t block_index = -1;
+void retrieveExt(char* filename, char* outputfname)
+{
+    int i = findDirectoryEntry(filename);
+    if(i == -1)
+    {
+        printError("Error: File not found.\n");
+        return;
+    }
 
-    // find a free inode
-    int32_t inode_index = findFreeInode();
-    if(inode_index == -1)
+    // "-" sends the file to stdout, so status messages move to stderr to keep the
+    // data stream clean
+    int to_stdout = !strcmp(outputfname, "-");
+    FILE * msg = to_stdout ? stderr : stdout;
+    int fd;
+
+    if(to_stdout)
     {
-      printf("ERROR: Can not find a free inode.\n");
-      return;
+        fflush(stdout);
+        fd = STDOUT_FILENO;
+    }
+    else
+    {
+        fd = open(outputfname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1)
+        {
+            printError("Could not open output file: %s\n", outputfname);
+            perror("Opening output file returned");
+            return;
+        }
     }
 
-    free_inodes[inode_index] = 0;
+    int32_t inode = directory[i].inode;
+    int retrieve_size = inodes[inode].file_size;
 
-    // place the file infor in the directory
-    inodes[inode_index].file_size = buf.st_size;
-    inodes[inode_index].hr = temp_info->tm_hour - 5;
-    inodes[inode_index].min =  temp_info->tm_min;
-    inodes[inode_index].sec = temp_info->tm_sec;
+    fprintf(msg, "Retrieving %d bytes to %s\n", retrieve_size, outputfname);
 
-    directory[directory_entry].in_use = 1;
-    directory[directory_entry].inode = inode_index;
-    strncpy(directory[directory_entry].filename, filename, strlen(filename));
+    // Blocks are gathered into a large buffer so the output sees a few big writes
+    // rather than one per block
+    static uint8_t buffer[RETRIEVE_BUFFER_SIZE];
+    int buffered = 0;
+    int block_index = 0;
+    int failed = 0;
 
-    // copy_size is initialized to the size of the input file so each loop iteration we
-    // will copy BLOCK_SIZE byt/es from the file then reduce our copy_size counter by
-    // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-    // we have copied all the data from the input file.
-    while( copy_size > 0 )
+    while(retrieve_size > 0)
     {
-        fseek( ifp, offset, SEEK_SET );
-    
-        // Read BLOCK_SIZE number of bytes from the input file and store them in our
-        // data array. 
+        int num_bytes = retrieve_size < BLOCK_SIZE ? retrieve_size : BLOCK_SIZE;
 
-        // find a free block
-        block_index = findFreeBlock();
+        if(verifyBlock(inodes[inode].blocks[block_index]))
+        {
+            fprintf(msg, "ERROR: Checksum mismatch in block %d of %s\n", block_index, filename);
+            failed = 1;
+            break;
+        }
 
-        if(block_index == -1)
+        memcpy(&buffer[buffered], data[inodes[inode].blocks[block_index]], num_bytes);
+        buffered += num_bytes;
+
+        if(buffered == RETRIEVE_BUFFER_SIZE)
         {
-            printf("ERROR: Can not find a free block.\n");
-            return;
-        }   
+            if(writeAll(fd, buffer, buffered))
+            {
+                perror("Writing output file returned");
+                failed = 1;
+                break;
+            }
+            buffered = 0;
+        }
+
+        retrieve_size -= num_bytes;
+        block_index++;
+    }
+
+    if(!failed && buffered && writeAll(fd, buffer, buffered))
+    {
+        perror("Writing output file returned");
+        failed = 1;
+    }
+
+    if(!to_stdout)
+    {
+        close(fd);
+    }
+
+    if(failed)
+    {
+        command_status = 1;
+    }
+    else
+    {
+        fprintf(msg, "File retrieved!\n");
+    }
+}
+
+void retrieve(char* filename)
+{
+    retrieveExt(filename, filename);
+}
+
+// Command traces. With --record every command is logged with the time it started,
+// how long it took, whether it failed and how many bytes of host data it read.
+// --replay runs a trace again against a fresh image, with synthesized input files of
+// the recorded sizes, and reports how long each command takes now.
+#define TRACE_HEADER "# mfs trace v1\n"
+#define MAX_REPLAY_SETUP 64
+
+struct replayEntry
+{
+    char * command;          // the command as it is run in the replay directory
+    char * recorded;         // the command as it was recorded
+    long long recorded_us;
+    int recorded_status;
+    long long replayed_us;
+    int replayed_status;
+};
+
+FILE * trace_fp;
+int replaying;
+int tracing_command;
+int64_t command_started;
+int64_t command_wall_time;
+long long command_payload;
+char traced_command[MAX_COMMAND_SIZE];
+char traced_stdin_name[64];
+
+struct replayEntry * replay_entries;
+int num_replay_entries;
+int num_replay_setup;
+int replay_position;
+int replay_stdout = -1;
+int replay_null = -1;
+char replay_dir[64];
+
+int64_t clockMicros(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Size of a host file a command reads, or -1 if it is stdin or can't be found
+long long payloadSize(char * hostfile)
+{
+    struct stat buf;
+    if(hostfile == NULL || !strcmp(hostfile, "-") || stat(hostfile, &buf) == -1)
+    {
+        return -1;
+    }
+    return buf.st_size;
+}
 
-        int32_t bytes  = fread( data[block_index], BLOCK_SIZE, 1, ifp );
+// Called once a command has been tokenized, before it runs
+void traceStart(char * command, char ** token)
+{
+    if(!trace_fp && !replaying)
+    {
+        return;
+    }
 
-        // save the block in the inode
-        int32_t inode_block = findFreeInodeBlock(inode_index);
-        inodes[inode_index].blocks[inode_block] = block_index;
-        free_blocks[block_index] = 0;
+    tracing_command = 1;
+    strncpy(traced_command, command, MAX_COMMAND_SIZE - 1);
+    traced_command[strcspn(traced_command, "\r\n")] = '\0';
 
-        // If bytes == 0 and we haven't reached the end of the file then something is 
-        // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-        // It means we've reached the end of our input file.
-        if( bytes == 0 && !feof( ifp ) )
+    command_payload = -1;
+    traced_stdin_name[0] = '\0';
+    if(!strcmp("insert", token[0]) && token[1])
+    {
+        command_payload = payloadSize(token[1]);
+        // Data streamed from stdin is only measured once it is stored
+        if(!strcmp(token[1], "-") && token[2])
         {
-            printf("ERROR: An error occured reading from the input file.\n");
-            return;
+            strncpy(traced_stdin_name, token[2], 63);
+            traced_stdin_name[63] = '\0';
         }
+    }
+    else if(!strcmp("write", token[0]) && token[1] && token[2])
+    {
+        command_payload = payloadSize(token[3]);
+    }
+    else if(!strcmp("append", token[0]) && token[1])
+    {
+        command_payload = payloadSize(token[2]);
+    }
+    else if(!strcmp("import-delta", token[0]))
+    {
+        command_payload = payloadSize(token[1]);
+    }
+
+    if(replaying)
+    {
+        // Replayed commands run quietly so the report is all that is left on stdout
+        fflush(stdout);
+        dup2(replay_null, STDOUT_FILENO);
+    }
 
-        // Clear the EOF file flag.
-        clearerr( ifp );
+    command_wall_time = clockMicros(CLOCK_REALTIME);
+    command_started = clockMicros(CLOCK_MONOTONIC);
+}
+
+// Called once the command has run, with fs_lock held
+void traceFinish()
+{
+    if(!tracing_command)
+    {
+        return;
+    }
+    tracing_command = 0;
 
-        // Reduce copy_size by the BLOCK_SIZE bytes.
-        copy_size -= BLOCK_SIZE;
-        
-        // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-        // the fseek at the top of the loop to position us to the correct spot.
-        offset    += BLOCK_SIZE;
+    long long duration = clockMicros(CLOCK_MONOTONIC) - command_started;
 
-        block_index = findFreeBlock();
+    if(replaying)
+    {
+        fflush(stdout);
+        dup2(replay_stdout, STDOUT_FILENO);
+
+        int i = replay_position++ - num_replay_setup;
+        if(i >= 0 && i < num_replay_entries)
+        {
+            replay_entries[i].replayed_us = duration;
+            replay_entries[i].replayed_status = command_status;
+        }
+        return;
     }
 
-    // We are done copying from the input file so close it out.
-    fclose( ifp );
+    if(traced_stdin_name[0] && !command_status)
+    {
+        int entry = findDirectoryEntry(traced_stdin_name);
+        if(entry != -1)
+        {
+            command_payload = inodes[directory[entry].inode].file_size;
+        }
+    }
 
+    fprintf(trace_fp, "%lld %lld %d %lld %s\n", (long long) command_wall_time, duration,
+            command_status, command_payload, traced_command);
+    fflush(trace_fp);
 }
 
-void Delete(char * filename)   
-// We have the name of the file, this function only works if we have a filesystem open
+// Start appending every command to the given trace file
+void startRecording(char * tracefile)
 {
-    int i =0; 
+    trace_fp = fopen(tracefile, "w");
+    if(trace_fp == NULL)
+    {
+        perror("Opening the trace file returned");
+        exit(1);
+    }
+    fprintf(trace_fp, TRACE_HEADER);
+    fflush(trace_fp);
+}
 
-    while(strcmp(directory[i].filename, filename) && i < NUM_FILES)
+// Fill an input file with size bytes of data that does not depend on the host
+void synthesizeInput(char * path, long long size, uint32_t seed)
+{
+    FILE * ofp = fopen(path, "w");
+    if(ofp == NULL)
     {
-        i++; 
+        perror("Creating a replay input returned");
+        exit(1);
     }
 
-    int32_t location = (directory[i].inode);
-    directory[i]. in_use = 0;
+    static uint32_t buffer[BLOCK_SIZE / 4];
+    uint32_t x = seed * 2654435761u + 1;
+    while(size > 0)
+    {
+        for(int i = 0; i < BLOCK_SIZE / 4; i++)
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            buffer[i] = x;
+        }
+        size_t n = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+        fwrite(buffer, 1, n, ofp);
+        size -= n;
+    }
+    fclose(ofp);
+}
 
-    inodes[location].in_use = 0;
+// The last path component, so host paths from the trace land in the replay directory
+char * replayPath(char * path)
+{
+    char * slash = strrchr(path, '/');
+    return slash && slash[1] ? slash + 1 : path;
+}
 
-    i =0;
-    int32_t index =  inodes[location].blocks[i];
+// Rewrite a recorded command to run in the replay directory. Host files the command
+// read are replaced with synthesized inputs of the recorded size, and images or
+// outputs keep their base names. Images that are opened successfully before the trace
+// creates them are created empty by the setup commands.
+char * replayCommand(char * recorded, long long payload, int status, int n,
+                     char ** setup, int * num_setup)
+{
+    char * token[MAX_NUM_ARGUMENTS] = { NULL };
+    char * copy = strdup(recorded);
+    char * rest = copy;
+    char * argument;
+    int count = 0;
+    while(count < MAX_NUM_ARGUMENTS && (argument = strsep(&rest, WHITESPACE)) != NULL)
+    {
+        if(*argument)
+        {
+            token[count++] = argument;
+        }
+    }
 
-    while((index != 0) && (i < BLOCKS_PER_FILE) )
-    {  
-        free_blocks[index] = 1;
-        i++;
-        index = inodes[location].blocks[i];
+    char input[32];
+    if(payload >= 0)
+    {
+        snprintf(input, sizeof(input), "input-%d", n);
+        synthesizeInput(input, payload, n);
+    }
+    else
+    {
+        // The host file was missing when recorded, so it stays missing
+        snprintf(input, sizeof(input), "missing-%d", n);
+    }
+
+    if(count > 1 && !strcmp("createfs", token[0]))
+    {
+        // The name comes after any striping options
+        token[count - 1] = replayPath(token[count - 1]);
+        if(*num_setup + 2 <= MAX_REPLAY_SETUP)
+        {
+            // Remember the name so a later open does not create it again
+            setup[(*num_setup)++] = NULL;
+            setup[(*num_setup)++] = strdup(token[count - 1]);
+        }
+    }
+    else if(count > 1 && !strcmp("open", token[0]))
+    {
+        // The name comes after --shared. An open that failed when recorded, most likely
+        // of a missing image, has to fail again, so nothing is created for it.
+        token[count - 1] = replayPath(token[count - 1]);
+        int created = status != 0;
+        for(int i = 1; i < *num_setup; i += 2)
+        {
+            created |= !strcmp(setup[i], token[count - 1]);
+        }
+        if(!created && *num_setup + 2 <= MAX_REPLAY_SETUP)
+        {
+            setup[(*num_setup)++] = "";
+            setup[(*num_setup)++] = strdup(token[count - 1]);
+        }
+    }
+    else if(count > 1 && !strcmp("insert", token[0]))
+    {
+        // Inserts without a name are stored under the host path
+        if(count == 2 && strcmp(token[1], "-"))
+        {
+            token[count++] = token[1];
+        }
+        if(count > 2)
+        {
+            token[1] = input;
+        }
+    }
+    else if(count > 3 && !strcmp("write", token[0]))
+    {
+        token[3] = input;
+    }
+    else if(count > 2 && !strcmp("append", token[0]))
+    {
+        token[2] = input;
+    }
+    else if(count > 2 && !strcmp("retrieve", token[0]) && strcmp(token[2], "-"))
+    {
+        token[2] = replayPath(token[2]);
+    }
+    else if(count > 2 && !strcmp("export-delta", token[0]) && strcmp(token[2], "-"))
+    {
+        token[2] = replayPath(token[2]);
+    }
+    else if(count > 1 && !strcmp("import-delta", token[0]) && strcmp(token[1], "-"))
+    {
+        token[1] = replayPath(token[1]);
     }
-}
 
+    char * command = calloc(1, MAX_COMMAND_SIZE);
+    for(int i = 0; i < count; i++)
+    {
+        size_t used = strlen(command);
+        snprintf(command + used, MAX_COMMAND_SIZE - used, i ? " %s" : "%s", token[i]);
+    }
+    free(copy);
+    return command;
+}
 
-void Undelete (char * filename)
+// Load a trace and move into a scratch directory to replay it. Returns the commands
+// to run, setup first.
+char ** startReplay(char * tracefile, int * num_commands)
 {
-  int i =0; 
-  while(strcmp((directory[i].filename), filename) && i < NUM_FILES)
-  { 
-    i++;
-  }
+    FILE * ifp = fopen(tracefile, "r");
+    if(ifp == NULL)
+    {
+        perror("Opening the trace file returned");
+        exit(1);
+    }
 
-  if(strcmp((directory[i].filename), filename))
-  {
-    printf("undelete: Can not find the file.\n"); 
-  }
-  else
-  {
-    directory[i].in_use = 1;
+    char line[MAX_COMMAND_SIZE + 128];
+    if(!fgets(line, sizeof(line), ifp) || strcmp(line, TRACE_HEADER))
+    {
+        fprintf(stderr, "%s is not an mfs trace\n", tracefile);
+        exit(1);
+    }
 
-    int32_t location = (directory[i].inode);
+    strcpy(replay_dir, "/tmp/mfs-replay-XXXXXX");
+    if(mkdtemp(replay_dir) == NULL || chdir(replay_dir) == -1)
+    {
+        perror("Creating the replay directory returned");
+        exit(1);
+    }
 
-    inodes[location].in_use = 1;
+    // Pairs of (kind, image name): NULL for images the trace creates itself, "" for
+    // images it opens without creating
+    char * setup[MAX_REPLAY_SETUP];
+    int num_setup = 0;
+    int capacity = 0;
+
+    while(fgets(line, sizeof(line), ifp))
+    {
+        long long wall_time;
+        long long duration;
+        long long payload;
+        int status;
+        int offset = 0;
+        if(line[0] == '#' ||
+           sscanf(line, "%lld %lld %d %lld %n", &wall_time, &duration, &status,
+                  &payload, &offset) != 4 || offset == 0)
+        {
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[offset] == '\0')
+        {
+            continue;
+        }
 
-    i = 0;
-    int32_t index =  inodes[location].blocks[i];
+        if(num_replay_entries == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            replay_entries = realloc(replay_entries, capacity * sizeof(struct replayEntry));
+        }
 
-    while((index != 0) && (i < BLOCKS_PER_FILE) )
-    {  
-      free_blocks[index] = 0;
-      i++;
-      index = inodes[location].blocks[i];
+        struct replayEntry * entry = &replay_entries[num_replay_entries];
+        entry->recorded = strdup(&line[offset]);
+        entry->command = replayCommand(entry->recorded, payload, status,
+                                       num_replay_entries, setup, &num_setup);
+        entry->recorded_us = duration;
+        entry->recorded_status = status;
+        entry->replayed_us = -1;
+        entry->replayed_status = 0;
+        num_replay_entries++;
     }
-  }
-}
-  
-void attrib(char * attribute, char * filename)
-{
-    uint8_t x;
+    fclose(ifp);
 
-    for(int i = 0; i < NUM_FILES; i++)
+    char ** commands = calloc(num_setup / 2 * 3 + num_replay_entries + 1, sizeof(char *));
+    int n = 0;
+    for(int i = 0; i < num_setup; i += 2)
     {
-        if(!strcmp(filename, directory[i].filename))
+        if(setup[i] != NULL)
         {
-            if(attribute[0] == '+')
-            {
-                if(attribute[1] == 'r')
-                {
-                    x = 2;
-                }
-                else if(attribute[1] == 'h')
-                {
-                    x = 1;
-                }
-                inodes[i].attribute = x;
-            }
-            else if(!strcmp(attribute, "-h") || !strcmp(attribute, "-r"))
-            {
-                inodes[i].attribute = 0;
-            }
+            char * command = malloc(MAX_COMMAND_SIZE);
+            snprintf(command, MAX_COMMAND_SIZE, "createfs %s", setup[i + 1]);
+            commands[n++] = command;
+            commands[n++] = "savefs";
+            commands[n++] = "close";
         }
     }
+    num_replay_setup = n;
+    for(int i = 0; i < num_replay_entries; i++)
+    {
+        commands[n++] = replay_entries[i].command;
+    }
+    *num_commands = n;
+
+    replay_null = open("/dev/null", O_RDWR);
+    replay_stdout = dup(STDOUT_FILENO);
+    dup2(replay_null, STDIN_FILENO);
+    replaying = 1;
+
+    printf("Replaying %d command(s) from %s in %s\n", num_replay_entries, tracefile,
+           replay_dir);
+    return commands;
 }
 
-void readFile(char * filename, int start_byte, int num_bytes)
+// Print the timing of every replayed command next to the recorded one, then the
+// totals for each kind of command, and remove the replay directory
+void finishReplay()
 {
-    for(int i = 0; i < NUM_FILES; i++)
+    struct
     {
-        if(!strcmp(filename, directory[i].filename))
+        char name[32];
+        int count;
+        long long recorded_us;
+        long long replayed_us;
+    } totals[64];
+    int num_totals = 0;
+    int mismatched = 0;
+
+    printf("%5s %12s %12s %7s  %s\n", "#", "recorded_us", "replayed_us", "status",
+           "command");
+    for(int i = 0; i < num_replay_entries; i++)
+    {
+        struct replayEntry * entry = &replay_entries[i];
+        if(entry->replayed_us < 0)
         {
-            int end_byte = start_byte + num_bytes;
-            int start_block = start_byte / BLOCK_SIZE;
-            int end_block = end_byte / BLOCK_SIZE;
+            printf("%5d %12lld %12s %7s  %s\n", i, entry->recorded_us, "-", "-",
+                   entry->recorded);
+            continue;
+        }
 
-            for(int j = start_block; j <= end_block; j++)
-            {
-                if(start_block == end_block)
-                {
-                    for(int k = start_byte % BLOCK_SIZE; k < end_byte % BLOCK_SIZE; k++)
-                    {
-                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
-                    }
-                }
-                else if(j == end_block)
-                {
-                    for(int k = 0; k < end_byte % BLOCK_SIZE; k++)
-                    {
-                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
-                    }
+        int differs = entry->recorded_status != entry->replayed_status;
+        mismatched += differs;
+        printf("%5d %12lld %12lld %3d/%-3d%s %s\n", i, entry->recorded_us,
+               entry->replayed_us, entry->recorded_status, entry->replayed_status,
+               differs ? "!" : " ", entry->recorded);
 
-                }
-                else if(j == start_block)
-                {
-                    for(int k = start_byte % BLOCK_SIZE; k < BLOCK_SIZE; k++)
-                    {
-                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
-                    }
-                }
-                else
-                {
-                    for(int k = 0; k < BLOCK_SIZE; k++)
-                    {
-                        printf("%x\n", data[inodes[directory[i].inode].blocks[j]][k]);
-                    }
-                }
-                
+        char name[32] = { 0 };
+        sscanf(entry->recorded, "%31s", name);
+        int t;
+        for(t = 0; t < num_totals && strcmp(totals[t].name, name); t++)
+        {
+        }
+        if(t == num_totals)
+        {
+            if(num_totals == 64)
+            {
+                continue;
             }
+            memset(&totals[t], 0, sizeof(totals[t]));
+            strcpy(totals[t].name, name);
+            num_totals++;
         }
+        totals[t].count++;
+        totals[t].recorded_us += entry->recorded_us;
+        totals[t].replayed_us += entry->replayed_us;
     }
-}
 
-void encryptFile(char * filename, char cipher)
-{
-    for(int i = 0; i < NUM_FILES; i++)
+    printf("\n%-14s %6s %12s %12s %8s\n", "command", "count", "recorded_us", "replayed_us",
+           "change");
+    for(int t = 0; t < num_totals; t++)
     {
-        if(!strcmp(filename, directory[i].filename))
-        {
-            int start_byte = 0;
-            int end_byte = inodes[directory[i].inode].file_size;
-            int start_block = 0;
-            int end_block = end_byte / BLOCK_SIZE;
-
-            for(int j = start_block; j <= end_block; j++)
-            {
-                if(start_block == end_block)
-                {
-                    for(int k = start_byte % BLOCK_SIZE; k < end_byte % BLOCK_SIZE; k++)
-                    {
-                        data[inodes[directory[i].inode].blocks[j]][k] = 
-                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
-                    }
-                }
-                else if(j == end_block)
-                {
-                    for(int k = 0; k < end_byte % BLOCK_SIZE; k++)
-                    {
-                        data[inodes[directory[i].inode].blocks[j]][k] = 
-                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
-                    }
+        double change = totals[t].recorded_us ?
+            100.0 * (totals[t].replayed_us - totals[t].recorded_us) / totals[t].recorded_us : 0;
+        printf("%-14s %6d %12lld %12lld %+7.1f%%\n", totals[t].name, totals[t].count,
+               totals[t].recorded_us, totals[t].replayed_us, change);
+    }
+    if(mismatched)
+    {
+        printf("%d command(s) marked ! succeeded or failed differently than recorded\n",
+               mismatched);
+    }
 
-                }
-                else if(j == start_block)
-                {
-                    for(int k = start_byte % BLOCK_SIZE; k < BLOCK_SIZE; k++)
-                    {
-                        data[inodes[directory[i].inode].blocks[j]][k] = 
-                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
-                    }
-                }
-                else
-                {
-                    for(int k = 0; k < BLOCK_SIZE; k++)
-                    {
-                        data[inodes[directory[i].inode].blocks[j]][k] = 
-                        (uint8_t)(((char) data[inodes[directory[i].inode].blocks[j]][k]) ^ cipher);
-                    }
-                }
-                
-            }
+    DIR * dir = opendir(replay_dir);
+    struct dirent * dent;
+    while(dir && (dent = readdir(dir)) != NULL)
+    {
+        if(strcmp(dent->d_name, ".") && strcmp(dent->d_name, ".."))
+        {
+            unlink(dent->d_name);
         }
     }
+    if(dir)
+    {
+        closedir(dir);
+    }
+    if(chdir("/") == 0)
+    {
+        rmdir(replay_dir);
+    }
 }
 
-void retrieve(char* filename)
+// Commands that change the image, which a shared image refuses
+int changesImage(char ** token)
 {
-    for(int i = 0; i < NUM_FILES; i++)
+    static const char * commands[] = { "savefs", "insert", "delete", "undel", "attrib",
+        "encrypt", "decrypt", "clone", "import-delta", "write", "append", "truncate", "sync",
+        "flusher", "checkpoint", "rollback", NULL };
+    int i;
+    for(i = 0; commands[i] != NULL; i++)
     {
-        if(!strcmp(filename, directory[i].filename))
+        if(!strcmp(commands[i], token[0]))
         {
-            FILE* ofp;
-            ofp = fopen(filename, "w");
-
-            if(ofp == NULL)
-            {
-                printf("Could not open output file: %s\n", filename);
-                perror("Opening output file returned");
-                return;
-            }
-            //inodes[directory[i].inode].blocks[0] = block_index;
-            int block_index = 0;
-            int retrieve_size = inodes[directory[i].inode].file_size;
-            int offset = 0;
-
-            printf("Retrieving %d bytes to %s\n", (int) inodes[directory[i].inode].file_size, filename);
+            return 1;
+        }
+    }
+    return (!strcmp("snapshot", token[0]) && token[1] != NULL) ||
+           (!strcmp("fsck", token[0]) && token[1] != NULL && !strcmp(token[1], "--repair"));
+}
 
-            while(retrieve_size > 0)
-            {
-                int num_bytes;
+uint32_t shared_generation;
+uint32_t shared_metadata_crc;
 
-                if(retrieve_size < BLOCK_SIZE)
-                {
-                    num_bytes = retrieve_size;
-                }
-                else 
-                {
-                    num_bytes = BLOCK_SIZE;
-                }
+// A reader of a shared image holds the data lock while a command runs, so the writer
+// can't change the files under it, and picks up whatever the writer saved in between
+void beginSharedCommand()
+{
+    if(!image_shared)
+    {
+        return;
+    }
 
-                fwrite(data[inodes[directory[i].inode].blocks[block_index]], num_bytes, 1, ofp);
-                
-                retrieve_size -= BLOCK_SIZE;
-                offset += BLOCK_SIZE;
-                block_index++;
+    if(lockImageData(F_RDLCK))
+    {
+        return;
+    }
+    holding_data_lock = 1;
 
-                fseek(ofp, offset, SEEK_SET);
-            }
-            
-            fclose(ofp);
-            printf("File retrieved!\n");
-        }
+    if(superblock->generation != shared_generation ||
+       superblock->metadata_crc != shared_metadata_crc)
+    {
+        shared_generation = superblock->generation;
+        shared_metadata_crc = superblock->metadata_crc;
+        invalidateIndexes();
     }
 }
 
-void retrieveExt(char* filename, char* outputfname)
+void endSharedCommand()
 {
-    for(int i = 0; i < NUM_FILES; i++)
+    if(holding_data_lock)
     {
-        if(!strcmp(filename, directory[i].filename))
-        {
-            FILE* ofp;
-            ofp = fopen(outputfname, "w");
+        lockImageData(F_UNLCK);
+        holding_data_lock = 0;
+    }
+}
 
-            if(ofp == NULL)
-            {
-                printf("Could not open output file: %s\n", outputfname);
-                perror("Opening output file returned");
-                return;
-            }
-            //inodes[directory[i].inode].blocks[0] = block_index;
-            int block_index = 0;
-            int retrieve_size = inodes[directory[i].inode].file_size;
-            int offset = 0;
+// Flush anything the flusher still holds and leave. Called with fs_lock held.
+void quitfs()
+{
+  traceFinish();
+  stopFlusher();
+  if(replaying)
+  {
+    finishReplay();
+  }
+  exit(exit_status);
+}
 
-            printf("Retrieving %d bytes to %s\n", (int) inodes[directory[i].inode].file_size, outputfname);
+int main(int argc, char * argv[])
+{
 
-            while(retrieve_size > 0)
-            {
-                int num_bytes;
+  char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
 
-                if(retrieve_size < BLOCK_SIZE)
-                {
-                    num_bytes = retrieve_size;
-                }
-                else 
-                {
-                    num_bytes = BLOCK_SIZE;
-                }
+  // Commands given with -c run in order, without a prompt, and the program quits after
+  // the last one. That leaves stdin and stdout free to carry file data for
+  // "insert - <name>" and "retrieve <name> -".
+  char ** scripted_commands = (char **) calloc(argc, sizeof(char *));
+  int num_scripted = 0;
+  int next_scripted = 0;
 
-                fwrite(data[inodes[directory[i].inode].blocks[block_index]], num_bytes, 1, ofp);
-                
-                retrieve_size -= BLOCK_SIZE;
-                offset += BLOCK_SIZE;
-                block_index++;
+  char * record_file = NULL;
+  char * replay_file = NULL;
 
-                fseek(ofp, offset, SEEK_SET);
-            }
-            
-            fclose(ofp);
-            printf("File retrieved!\n");
-        }
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "-c") && i + 1 < argc)
+    {
+      scripted_commands[num_scripted++] = argv[++i];
     }
-}
-
-int main()
-{
+    else if(!strcmp(argv[i], "--record") && i + 1 < argc)
+    {
+      record_file = argv[++i];
+    }
+    else if(!strcmp(argv[i], "--replay") && i + 1 < argc)
+    {
+      replay_file = argv[++i];
+    }
+    else if(!strcmp(argv[i], "--direct"))
+    {
+      direct_io = 1;
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [--direct] [-c <command>]... [--record <trace>]\n"
+                      "       %s [--direct] --replay <trace>\n", argv[0], argv[0]);
+      exit(1);
+    }
+  }
 
-  char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
+  if(replay_file && (num_scripted || record_file))
+  {
+    fprintf(stderr, "--replay can not be combined with other options\n");
+    exit(1);
+  }
 
-  fp = NULL;
+  if(record_file)
+  {
+    startRecording(record_file);
+  }
+  else if(replay_file)
+  {
+    // The trace is run through the same path as -c commands
+    free(scripted_commands);
+    scripted_commands = startReplay(replay_file, &num_scripted);
+  }
 
   init();
+
+  // Commands run with fs_lock held; it is only let go while waiting for input
+  pthread_mutex_lock(&fs_lock);
   
   while(1)
   {
-    // Print out the msh prompt
-    printf ("mfs> ");
-
-    // Read the command from the commandline.  The
-    // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while(!fgets(command_string, MAX_COMMAND_SIZE, stdin));
+    traceFinish();
+    endSharedCommand();
+
+    // A replay compares results with the trace rather than stopping at failures
+    if(command_status && num_scripted && !replaying)
+    {
+      exit_status = 1;
+    }
+
+    // Wake the flusher early once enough dirty data has piled up
+    if(flusher_running && flushDue())
+    {
+      pthread_cond_signal(&flush_wake);
+    }
+
+    int have_command = 1;
+    pthread_mutex_unlock(&fs_lock);
+
+    if(num_scripted)
+    {
+      if(next_scripted == num_scripted)
+      {
+        have_command = 0;
+      }
+      else
+      {
+        strncpy(command_string, scripted_commands[next_scripted++], MAX_COMMAND_SIZE - 1);
+        command_string[MAX_COMMAND_SIZE - 1] = '\0';
+      }
+    }
+    else
+    {
+      // Print out the msh prompt
+      printf ("mfs> ");
+
+      // Read the command from the commandline.  The
+      // maximum command that will be read is MAX_COMMAND_SIZE
+      // fgets only returns NULL at the end of the input, e.g.
+      // ctrl-d or the end of a piped script, so quit then
+      if(!fgets(command_string, MAX_COMMAND_SIZE, stdin))
+      {
+        have_command = 0;
+      }
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    if(!have_command)
+    {
+      quitfs();
+    }
   
     /* Parse input */
     char *token[MAX_NUM_ARGUMENTS];
@@ -807,15 +4692,70 @@ int main()
     }
     
 
+    // blank lines have no command
+    if(token[0] == NULL)
+    {
+        continue;
+    }
+
+    command_status = 0;
+    traceStart(command_string, token);
+
+    if(image_shared && changesImage(token))
+    {
+        printError("ERROR: The image is shared read-only.\n");
+        continue;
+    }
+    beginSharedCommand();
+
     // process the filesystem commands
     if(strcmp("createfs", token[0]) == 0)
     {
-        if(token[1] == NULL)
+        int stripes = 1;
+        int chunk = DEFAULT_STRIPE_CHUNK;
+        int i;
+
+        for(i = 1; i + 1 < MAX_NUM_ARGUMENTS && token[i] != NULL &&
+                   token[i + 1] != NULL; i += 2)
+        {
+            if(!strcmp(token[i], "--stripe"))
+            {
+                stripes = atoi(token[i + 1]);
+            }
+            else if(!strcmp(token[i], "--chunk"))
+            {
+                chunk = atoi(token[i + 1]);
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        if(token[i] == NULL)
+        {
+            printError("ERROR: No filename specified\n");
+            continue;
+        }
+
+        if(stripes < 1 || stripes > MAX_STRIPES || chunk < 1 || chunk > NUM_BLOCKS ||
+           !strncmp(token[i], "--", 2) || (i + 1 < MAX_NUM_ARGUMENTS && token[i + 1] != NULL))
+        {
+            printError("ERROR: Usage: createfs [--stripe N] [--chunk blocks] <filename>, "
+                       "with N from 1 to %d\n", MAX_STRIPES);
+            continue;
+        }
+
+        // open --shared maps each chunk on its own, which needs whole pages. That also
+        // keeps the mapping count, 16384 at most with 4K pages, under vm.max_map_count.
+        long page_blocks = sysconf(_SC_PAGESIZE) / BLOCK_SIZE;
+        if(stripes > 1 && page_blocks > 1 && chunk % page_blocks)
         {
-            printf("ERROR: No filename specified\n");
+            printError("ERROR: The chunk size must be a multiple of %ld blocks.\n", page_blocks);
             continue;
         }
-        createfs(token[1]);
+
+        createfs(token[i], stripes, chunk);
     }
     else if(!strcmp("savefs", token[0]))
     {
@@ -823,23 +4763,47 @@ int main()
     }
     else if(!strcmp("open", token[0]))
     {
-        if(token[1] == NULL)
+        int shared = token[1] != NULL && !strcmp(token[1], "--shared");
+        if(token[1 + shared] == NULL)
         {
-            printf("ERROR: No filename specified\n");
+            printError("ERROR: No filename specified\n");
             continue;
         }
-        openfs(token[1]);
+        openfs(token[1 + shared], shared);
     }
     else if(!strcmp("close", token[0]))
     {
         closefs();
     }
+    else if(!strcmp("checkpoint", token[0]) || !strcmp("rollback", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL)
+        {
+            printError("ERROR: Usage: %s <checkpoint>\n", token[0]);
+            continue;
+        }
+
+        if(!strcmp("checkpoint", token[0]))
+        {
+            checkpoint(token[1]);
+        }
+        else
+        {
+            rollback(token[1]);
+        }
+    }
     else if(!strcmp("list", token[0]))
     {
        
          if(!image_open)
         {
-            printf("ERROR: Disk image is not opened.\n");
+            printError("ERROR: Disk image is not opened.\n");
             continue;
         }
         if(token[1])
@@ -851,11 +4815,135 @@ int main()
             list("nothing");
         } 
     }
+    else if(!strcmp("find", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        struct findQuery query;
+        memset(&query, 0, sizeof(query));
+        int valid = 1;
+
+        for(int i = 1; i < MAX_NUM_ARGUMENTS && token[i] != NULL; i += 2)
+        {
+            char * value = i + 1 < MAX_NUM_ARGUMENTS ? token[i + 1] : NULL;
+            if(value == NULL)
+            {
+                valid = 0;
+            }
+            else if(!strcmp(token[i], "--name-prefix"))
+            {
+                query.name_prefix = value;
+            }
+            else if(!strcmp(token[i], "--min-size"))
+            {
+                query.has_min_size = 1;
+                query.min_size = strtoul(value, NULL, 10);
+            }
+            else if(!strcmp(token[i], "--max-size"))
+            {
+                query.has_max_size = 1;
+                query.max_size = strtoul(value, NULL, 10);
+            }
+            else if(!strcmp(token[i], "--newer"))
+            {
+                // An epoch time, or -N for the last N seconds
+                query.has_newer = 1;
+                query.newer = strtoll(value, NULL, 10);
+                if(query.newer < 0)
+                {
+                    query.newer += time(0);
+                }
+            }
+            else if(!strcmp(token[i], "--attr") && (value[0] == '+' || value[0] == '-') &&
+                    (value[1] == 'h' || value[1] == 'r'))
+            {
+                uint8_t bit = value[1] == 'h' ? 1 : 2;
+                if(value[0] == '+')
+                {
+                    query.attr_set |= bit;
+                }
+                else
+                {
+                    query.attr_clear |= bit;
+                }
+            }
+            else
+            {
+                valid = 0;
+            }
+        }
+
+        if(!valid)
+        {
+            printError("ERROR: Usage: find [--name-prefix P] [--min-size N] [--max-size N] "
+                   "[--newer T] [--attr +h|+r]\n");
+            continue;
+        }
+
+        find(&query);
+    }
+    else if(!strcmp("search", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        int hex = 0;
+        char * files_glob = NULL;
+        int valid = token[1] != NULL;
+
+        for(int i = 2; valid && i < MAX_NUM_ARGUMENTS && token[i] != NULL; i++)
+        {
+            if(!strcmp(token[i], "--hex"))
+            {
+                hex = 1;
+            }
+            else if(!strcmp(token[i], "--files") && i + 1 < MAX_NUM_ARGUMENTS &&
+                    token[i + 1] != NULL)
+            {
+                files_glob = token[++i];
+            }
+            else
+            {
+                valid = 0;
+            }
+        }
+
+        if(!valid)
+        {
+            printError("ERROR: Usage: search <pattern> [--hex] [--files glob]\n");
+            continue;
+        }
+
+        uint8_t pattern[MAX_PATTERN_SIZE];
+        int length = strlen(token[1]);
+        if(hex)
+        {
+            length = parseHex(token[1], pattern, MAX_PATTERN_SIZE);
+            if(length == -1)
+            {
+                printError("ERROR: The pattern is not a string of hex byte pairs.\n");
+                continue;
+            }
+        }
+        else
+        {
+            memcpy(pattern, token[1], length);
+        }
+
+        search(pattern, length, files_glob);
+    }
     else if(!strcmp("df", token[0]))
     {
         if(!image_open)
         {
-            printf("ERROR: Disk image is not opened.\n");
+            printError("ERROR: Disk image is not opened.\n");
             continue;
         }
 
@@ -863,56 +4951,85 @@ int main()
     }
     else if(!strcmp(token[0], "quit") || !strcmp(token[0], "exit"))
     {
-        exit(0);
+        quitfs();
+    }
+    else if(!strcmp("flusher", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL)
+        {
+            if(flusher_running)
+            {
+                printf("flusher: every %d s, %u dirty bytes, %d blocks dirty\n",
+                       flush_interval, flush_threshold, dirty_count);
+            }
+            else
+            {
+                printf("flusher: off\n");
+            }
+        }
+        else if(!strcmp(token[1], "off"))
+        {
+            stopFlusher();
+        }
+        else if(atoi(token[1]) <= 0)
+        {
+            printError("ERROR: Usage: flusher <seconds> [<dirty-bytes>] | flusher off\n");
+        }
+        else
+        {
+            startFlusher(atoi(token[1]), token[2] ? strtoul(token[2], NULL, 10) : 0);
+        }
     }
     else if(!strcmp("insert", token[0]))
     {
         if(!image_open)
         {
-            printf("ERROR: Disk image is not opened.\n");
+            printError("ERROR: Disk image is not opened.\n");
             continue;
         }
 
         if(token[1] == NULL)
         {
-            printf("ERROR: No filename specified");
+            printError("ERROR: No filename specified");
             continue;
         }
 
-        insert(token[1]);
+        insert(token[1], token[2]);
     }
     else if(!strcmp("delete",token[0]))
     {
       
-      int i;
-
-      for( i = 0; i<NUM_FILES;i++)
+      if(!image_open)
       {
-        if(!(strcmp(token[1],directory[i].filename)))
-        {
-          break;
-        }
+        printError("ERROR: Disk image is not opened.\n");
+        continue;
       }
 
-      if(inodes[i].attribute != 2)
+      if(token[1] == NULL)
       {
-        if(!image_open)
-        {
-          printf("ERROR: Disk image is not opened.\n");
-          continue;
-        }
+       printError("ERROR: No file specified\n");
+       continue;
+      }
 
-        if(token[1] == NULL)
-        {
-         printf("ERROR: No file specified\n");
-         continue;
-        }
+      int i = findDirectoryEntry(token[1]);
 
+      if(i == -1)
+      {
+        printError("ERROR: File not found.\n");
+      }
+      else if(inodes[directory[i].inode].attribute != 2)
+      {
         Delete(token[1]);
       }
       else
       {
-        printf("ERROR: Can't delete an read-only file\n");
+        printError("ERROR: Can't delete an read-only file\n");
       }
 
     }
@@ -920,13 +5037,13 @@ int main()
     {
         if(!image_open)
         {
-          printf("ERROR: Disk image is not opened.\n");
+          printError("ERROR: Disk image is not opened.\n");
           continue;
         }
 
         if(token[1] == NULL)
         {
-         printf("ERROR: No file specified\n");
+         printError("ERROR: No file specified\n");
          continue;
         }
 
@@ -940,33 +5057,33 @@ int main()
         }
         else
         {
-            printf("GIVE ME RIGHT # PARAMETERS!!!!!\n");
+            printError("GIVE ME RIGHT # PARAMETERS!!!!!\n");
         }
     }
     else if(!strcmp("read", token[0]))
     {
         if(!image_open)
         {
-            printf("ERROR: Disk image is not opened.\n");
+            printError("ERROR: Disk image is not opened.\n");
             continue;
         }
 
         if(token[1] == NULL)
         {
-            printf("ERROR: No file given.\n");
+            printError("ERROR: No file given.\n");
             continue;
         }
 
         if(token[2] == NULL)
         {
-            printf("ERROR: No start byte given.\n");
+            printError("ERROR: No start byte given.\n");
             continue;
         }
 
 
         if(token[3] == NULL)
         {
-            printf("ERROR: No end byte given.\n");
+            printError("ERROR: No end byte given.\n");
             continue;
         }
 
@@ -977,35 +5094,230 @@ int main()
     {
         if(!image_open)
         {
-            printf("ERROR: Disk image is not opened.\n");
+            printError("ERROR: Disk image is not opened.\n");
             continue;
         }
 
         if(token[1] == NULL)
         {
-            printf("ERROR: No filename specified.\n");
+            printError("ERROR: No filename specified.\n");
             continue;
         }
 
         if(token[2] == NULL)
         {
-            printf("ERROR: No cipher specified.\n");
+            printError("ERROR: No cipher specified.\n");
             continue;
         }
 
         if(strlen(token[2]) > 1)
         {
-            printf("Error: Cipher must be only one byte in length.\n");
+            printError("Error: Cipher must be only one byte in length.\n");
             continue;
         }
 
         encryptFile(token[1], *token[2]);
     }
+    else if(!strcmp("scrub", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(scrub(0))
+        {
+            command_status = 1;
+        }
+    }
+    else if(!strcmp("clone", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printError("ERROR: Usage: clone <source> <destination>\n");
+            continue;
+        }
+
+        cloneFile(token[1], token[2]);
+    }
+    else if(!strcmp("snapshot", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL)
+        {
+            snapshotList();
+        }
+        else if(!strcmp(token[1], "-d") || !strcmp(token[1], "-r"))
+        {
+            if(token[2] == NULL)
+            {
+                printError("ERROR: No snapshot specified.\n");
+                continue;
+            }
+
+            if(token[1][1] == 'd')
+            {
+                snapshotDelete(token[2]);
+            }
+            else
+            {
+                snapshotRestore(token[2]);
+            }
+        }
+        else
+        {
+            snapshotCreate(token[1]);
+        }
+    }
+    else if(!strcmp("fsck", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        // Problems count as a failure even once repaired, so scripts notice them
+        if(fsck(token[1] != NULL && !strcmp(token[1], "--repair")))
+        {
+            command_status = 1;
+        }
+    }
+    else if(!strcmp("export-delta", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printError("ERROR: Usage: export-delta <since-generation> <file>\n");
+            continue;
+        }
+
+        exportDelta(strtoul(token[1], NULL, 10), token[2]);
+    }
+    else if(!strcmp("import-delta", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL)
+        {
+            printError("ERROR: Usage: import-delta <file>\n");
+            continue;
+        }
+
+        importDelta(token[1]);
+    }
+    else if(!strcmp("generation", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        printf("generation %u\n", superblock->generation);
+    }
+    else if(!strcmp("write", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL || token[2] == NULL || token[3] == NULL)
+        {
+            printError("ERROR: Usage: write <filename> <offset> <hostfile>\n");
+            continue;
+        }
+
+        if(atoi(token[2]) < 0)
+        {
+            printError("ERROR: Offset can not be negative.\n");
+            continue;
+        }
+
+        writeFile(token[1], atoi(token[2]), token[3]);
+    }
+    else if(!strcmp("append", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printError("ERROR: Usage: append <filename> <hostfile>\n");
+            continue;
+        }
+
+        appendFile(token[1], token[2]);
+    }
+    else if(!strcmp("truncate", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printError("ERROR: Usage: truncate <filename> <size>\n");
+            continue;
+        }
+
+        if(atoi(token[2]) < 0)
+        {
+            printError("ERROR: Size can not be negative.\n");
+            continue;
+        }
+
+        truncateFile(token[1], atoi(token[2]));
+    }
+    else if(!strcmp("sync", token[0]))
+    {
+        if(!image_open)
+        {
+            printError("ERROR: Disk image is not opened.\n");
+            continue;
+        }
+
+        if(token[1] == NULL)
+        {
+            printError("ERROR: Usage: sync <hostdir>\n");
+            continue;
+        }
+
+        syncDirectory(token[1]);
+    }
     else if(!strcmp("retrieve", token[0]))
     {
         if(token[1] == NULL)
         {
-            printf("ERROR: No filename specified.\n");
+            printError("ERROR: No filename specified.\n");
             continue;
         }
         else if(token[1] && (token[2] == NULL))
@@ -1020,7 +5332,7 @@ int main()
     }
     else
     {
-        printf("Error: Invalid command.\n");
+        printError("Error: Invalid command.\n");
     }
 
 